@@ -9,8 +9,12 @@
     When at least one FILE is specified, create a new archive.
     If FILE is a directory, add all of its contents to the archive file, recursively.     
     When no FILE argument is specified, unpack the ARCHIVE file.
+    With --armor, the archive is written or read as base64 text, encoded and decoded as it streams.
 */
 
+/* Define GNU for copy_file_range() and splice() in fastio.h, before any include */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,6 +25,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include "fastio.h"
 
 /**
  * Like mkdir, but creates parent paths as well
@@ -82,10 +87,10 @@ getcwd_a(void)
  * Packs a single file or directory recursively
  *
  * @param fn The filename to pack
- * @param outfp The file to write encoded output to
+ * @param out The archive to write encoded output to
  */
 void
-pack(char * const fn, FILE *outfp)
+pack(char * const fn, struct fioWriter *out)
 {
   struct stat st;
   stat(fn, &st);
@@ -95,7 +100,7 @@ pack(char * const fn, FILE *outfp)
     if(fn[strlen(fn) - 1]!= '/'){
       nameLen += 1;
       fprintf(stderr, "Recursing `%s/'\n", fn);
-      int a = fprintf(outfp, "%zu:%s/", nameLen, fn);
+      int a = fioPrintf(out, "%ld:%s/", nameLen, fn);
       if(a < 0){
         fprintf(stderr, "Error writing to file");
         exit(1);
@@ -103,7 +108,7 @@ pack(char * const fn, FILE *outfp)
     }
     else{
       fprintf(stderr, "Recursing `%s'\n", fn);
-      int a = fprintf(outfp, "%zu:%s", nameLen, fn);
+      int a = fioPrintf(out, "%ld:%s", nameLen, fn);
       if(a < 0){
         fprintf(stderr, "Error writing to file");
         exit(1);
@@ -125,52 +130,38 @@ pack(char * const fn, FILE *outfp)
             cwd = strcat(cwd, fn);
             chdir(cwd);
             char* rec = aDir->d_name;
-            pack(rec, outfp);
+            pack(rec, out);
             free(cwd);
         }
     }
     closedir(currDir);
     chdir("..");
-    fwrite("0:", sizeof(char), 2, outfp);
+    fioWrite(out, "0:", 2);
   }
   else if (S_ISREG(st.st_mode))
   {
     long int len = strlen(fn);
     fprintf(stderr, "Packing `%s'\n", fn);
-    FILE* fn1;
-    if((fn1 = fopen(fn, "r")) == NULL){
+    int fd = open(fn, O_RDONLY);
+    if(fd == -1){
       fprintf(stderr, "Could not open file");
       exit(1);
     }
-    char c[1];
-    int index = 1;
-    char *message = calloc(sizeof(char), 1);
-    while(!feof(fn1)){
-        size_t i = fread(c, sizeof(char), 1, fn1);
-        if(i == 0){
-          break;
-        }
-        message = realloc(message, (index+1)*sizeof(char));
-        message[index - 1] = c[0];
-        ++index;
-    }
-    message[index - 1] = 0;
-    fclose(fn1);
-    if (st.st_size == 0){
-      int a = fprintf(outfp, "%zu:%s%ld:", len, fn, st.st_size);
-      if(a < 0){
-        fprintf(stderr, "Error writing to file");
-        exit(1);
-      }
+    int a = fioPrintf(out, "%ld:%s%ld:", len, fn, (long)st.st_size);
+    /* Contents go in unchanged, so the kernel copies them without a trip through this process */
+    long long copied = a < 0 ? -1 : fioSplice(out, fd, st.st_size);
+    if(copied < 0){
+      fprintf(stderr, "Error writing to file");
+      exit(1);
     }
-    else{
-      int a = fprintf(outfp, "%zu:%s%ld:%s", len, fn, st.st_size, message);
-      if(a < 0){
-        fprintf(stderr, "Error writing to file");
-        exit(1);
+    close(fd);
+    /* The file shrank since stat(), pad it to the size in the header */
+    if(copied < st.st_size){
+      fprintf(stderr, "`%s' changed while packing\n", fn);
+      for(; copied < st.st_size; ++copied){
+        fioPutc(out, 0);
       }
     }
-    free(message);
   }
   else
   {
@@ -178,202 +169,139 @@ pack(char * const fn, FILE *outfp)
   }
 }
 
+/**
+ * Reads a decimal length field, up to and including its ':'
+ *
+ * @param in The archive
+ * @param value Set to the length
+ * @return 0, or -1 at the end of the archive
+ */
+int
+readLength(struct fioReader *in, long *value)
+{
+  char digits[32];
+  size_t n = 0;
+  int c;
+  while((c = fioGetc(in)) != ':'){
+    if(c == EOF){
+      return -1;
+    }
+    if(n < sizeof(digits) - 1){
+      digits[n++] = c;
+    }
+  }
+  digits[n] = 0;
+  *value = atol(digits);
+  return 0;
+}
+
 /**
  * Unpacks an entire archive
  *
- * @param fp The archive to unpack
+ * @param in The archive to unpack
  */
 int
-unpack(FILE *fp, const char* fn)
+unpack(struct fioReader *in, const char* fn)
 {
+  long fileNameLength;
   /* If file is 0 - indicates EOD */
   if(!strcmp(fn, "0")){
     chdir("..");
-    char* temp = calloc(sizeof(char), 1);
-    int i = 1;
-    char c[1] = {'a'};
-    while(c[0] != ':'){
-      temp = realloc(temp, i*sizeof(char));
-      size_t j = fread(c, sizeof(char), 1, fp);
-      if(j < sizeof(char)){
-          // END OF FILE
-          free(temp);
-          return 0;
-      }
-      temp[i - 1] = c[0];
-      ++i;
+    if(readLength(in, &fileNameLength)){
+      // END OF FILE
+      return 0;
     }
-    temp[i - 2] = 0;
-    int fileNameLength = atoi(temp);
     if(fileNameLength == 0){
-        unpack(fp, "0");
+        unpack(in, "0");
     }
     else{
-        char fileName[fileNameLength];
-        size_t j = fread(fileName, sizeof(char), fileNameLength, fp);
-        if(j < sizeof(char)){
+        char fileName[fileNameLength + 1];
+        if(fioRead(in, fileName, fileNameLength) < (size_t)fileNameLength){
           // END OF FILE
-          free(temp);
           return 0;
         }
         fileName[fileNameLength] = 0;
-        unpack(fp, fileName);
+        unpack(in, fileName);
     }
-    free(temp);
   }
   else if (fn[strlen(fn)-1] == '/')
   {
     /* If file ends with '/' indicates it is a directory, mkpath() */
     if (mkpath(fn, 0700)) err(errno, "mkpath()");
     fprintf(stderr, "Recursing into `%s'\n", fn);
-    char* temp = calloc(sizeof(char), 1);
-    int i = 1;
-    char c[1] = {'a'};
-    while(c[0] != ':'){
-      temp = realloc(temp, i*sizeof(char));
-      size_t j = fread(c, sizeof(char), 1, fp);
-      if(j < sizeof(char)){
-          // END OF FILE
-          free(temp);
-          return 0;
-      }
-      temp[i - 1] = c[0];
-      ++i;
+    if(readLength(in, &fileNameLength)){
+      // END OF FILE
+      return 0;
     }
-    temp[i - 2] = 0;                               
-    int fileNameLength = atoi(temp);
     if(fileNameLength == 0){
-        unpack(fp, "0");
+        unpack(in, "0");
     }
     else{
-        char fileName[fileNameLength];
-        size_t j = fread(fileName, sizeof(char), fileNameLength, fp);
-        if(j < sizeof(char)){
+        char fileName[fileNameLength + 1];
+        if(fioRead(in, fileName, fileNameLength) < (size_t)fileNameLength){
           // END OF FILE
-          free(temp);
           return 0;
         }
         fileName[fileNameLength] = 0;
         chdir(fn);
-        unpack(fp, fileName);
+        unpack(in, fileName);
     }
-    free(temp);
   }
   else
   {
     /* Regular file for unpacking */
     fprintf(stderr, "Unpacking file %s\n", fn);
-    FILE* fileRead;
-    if((fileRead = fopen(fn, "r"))){
+    if(!access(fn, R_OK)){
       /* If the file is the argument passed to the executable aka the first file */
-      fclose(fileRead);
-      char* temp = calloc(sizeof(char), 1);
-      int i = 1;
-      char c[1] = {'0'};
-      while(c[0] != ':'){
-        temp = realloc(temp, i*sizeof(char));
-        size_t j = fread(c, sizeof(char), 1, fp);
-        if(j < sizeof(char)){
-          // END OF FILE
-          free(temp);
-          return 0;
-        }
-        temp[i - 1] = c[0];
-        ++i;
+      if(readLength(in, &fileNameLength)){
+        // END OF FILE
+        return 0;
       }
-      temp[i - 2] = 0;                                           
-      int fileNameLength = atoi(temp);
-      free(temp);
-      char fileName[fileNameLength];
-      size_t j = fread(fileName, sizeof(char), fileNameLength, fp);
-      if(j < sizeof(char)){
+      char fileName[fileNameLength + 1];
+      if(fileNameLength == 0 || fioRead(in, fileName, fileNameLength) < (size_t)fileNameLength){
           // END OF FILE
           return 0;
       }
       fileName[fileNameLength] = 0;
-      unpack(fp, fileName);
+      unpack(in, fileName);
     }
     else{
       /* Not the first file, create regular file */
-      char* temp = calloc(sizeof(char), 1);
-      int i = 1;
-      char c[1] = {'0'};
-      while(c[0] != ':'){
-        temp = realloc(temp, i*sizeof(char));
-        size_t j = fread(c, sizeof(char), 1, fp);
-        if(j < sizeof(char)){
-            // END OF FILE
-            free(temp);
-            return 0;
-        }
-        temp[i - 1] = c[0];
-        ++i;
-      }
-      temp[i - 2] = 0;                                          
-      int fileLength = atoi(temp);
-      if(fileLength == 0){
-          // File has no content
-          FILE* newFile = fopen(fn, "w");
-          if(newFile == NULL){
-            fprintf(stderr, "Could not create new file");
-            exit(1);
-          }
-          fclose(newFile);
+      long fileLength;
+      if(readLength(in, &fileLength)){
+          // END OF FILE
+          return 0;
       }
-      else{
-        char fileMessage[fileLength];
-        size_t j = fread(fileMessage, sizeof(char), fileLength, fp);
-        if(j < sizeof(char)){
-            // END OF FILE
-            free(temp);
-            return 0;
-        }
-        fileMessage[fileLength] = 0;
-        FILE* newFile = fopen(fn, "w");
-        if(newFile == NULL){
-          fprintf(stderr, "Could not create new file");
-          exit(1);
-        }
-        fwrite(fileMessage, sizeof(char), fileLength, newFile);
-        fclose(newFile);
+      int newFile = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if(newFile == -1){
+        fprintf(stderr, "Could not create new file");
+        exit(1);
       }
-      free(temp);
-      temp = calloc(sizeof(char), 1);
-      i = 1;
-      c[0] = 'a';
-      while(c[0] != ':' && !(feof(fp))){
-        temp = realloc(temp, i*sizeof(char));
-        size_t j = fread(c, sizeof(char), 1, fp);
-        if(j < sizeof(char)){
-            // END OF FILE
-            free(temp);
-            return 0;
-        }
-        temp[i - 1] = c[0];
-        ++i;
+      /* Contents come out unchanged, copied straight from the archive to the new file */
+      long long copied = fileLength == 0 ? 0 : fioCopy(in, newFile, fileLength);
+      close(newFile);
+      if(copied < fileLength){
+          // END OF FILE
+          return 0;
       }
-      temp[i - 2] = 0;                              
-      int fileNameLength = atoi(temp);
-      if(temp == NULL){
-        // END
+      if(readLength(in, &fileNameLength)){
+          // END OF FILE
+          return 0;
       }
-      else if(fileNameLength == 0){
+      if(fileNameLength == 0){
           // Pass 0 argument in recursion indicating End of Directory
-          unpack(fp, "0");
+          unpack(in, "0");
       }
       else{
           // Recursively pass next file to be unpacked
-          char fileName[fileNameLength];
-          size_t j = fread(fileName, sizeof(char), fileNameLength, fp);
-          if(j < sizeof(char)){
+          char fileName[fileNameLength + 1];
+          if(fioRead(in, fileName, fileNameLength) < (size_t)fileNameLength){
               // END OF FILE
-              free(temp);
               return 0;
           }
           fileName[fileNameLength] = 0;
-          unpack(fp, fileName);
+          unpack(in, fileName);
       }
-      free(temp);
     }
   }
   return 0;
@@ -382,33 +310,58 @@ unpack(FILE *fp, const char* fn)
 int
 main(int argc, char *argv[])
 {
+  /* --armor streams the archive through a base64 layer, no temporary file is needed */
+  int armor = argc > 1 && !strcmp(argv[1], "--armor");
+  if (armor) {
+    argv[1] = argv[0];
+    ++argv;
+    --argc;
+  }
   if (argc < 2) {
-    fprintf(stderr, "Usage: %s FILE... OUTFILE\n"
-                    "       %s INFILE\n", argv[0], argv[0]);
+    fprintf(stderr, "Usage: %s [--armor] FILE... OUTFILE\n"
+                    "       %s [--armor] INFILE\n", argv[0], argv[0]);
     exit(1);
   }
   char *fn = argv[argc-1];
   if (argc > 2)
   { /* Packing files */
-    FILE *fp = fopen(fn, "w");
-    if(fp == NULL){
+    int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd == -1){
       fprintf(stderr, "Could not create file for packing");
       exit(1);
     }
+    struct fioWriter out;
+    fioWriterOpen(&out, fd, 0);
+    if (armor)
+      fioWriterArmor(&out);
     for (int argind = 1; argind < argc - 1; ++argind)
     {
-        pack(argv[argind], fp);
+        pack(argv[argind], &out);
+    }
+    if(fioWriterClose(&out)){
+      fprintf(stderr, "Error writing to file");
+      exit(1);
     }
-    fclose(fp);
+    close(fd);
   }
   else
   { /* Unpacking an archive file */
-    FILE *fp = fopen(fn, "r");
-    if(fp == NULL){
+    int fd = open(fn, O_RDONLY);
+    if(fd == -1){
       fprintf(stderr, "Unable to open file to unpack\n");
       exit(1);
     }
-    unpack(fp, fn);
-    fclose(fp);
+    /* Not mapped: file contents are copied out by the kernel from the archive's offset */
+    struct fioReader in;
+    fioReaderOpen(&in, fd, 0, 0);
+    if (armor)
+      fioReaderArmor(&in);
+    unpack(&in, fn);
+    if (in.error == EILSEQ) {
+      fprintf(stderr, "Invalid base64 in `%s'\n", fn);
+      exit(1);
+    }
+    fioReaderClose(&in);
+    close(fd);
   }
-}
\ No newline at end of file
+}
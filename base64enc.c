@@ -12,76 +12,77 @@
     The data are encoded as described in the standard base64 alphabet in RFC 4648.
 */
 
+// Define GNU for copy_file_range() and splice() in fastio.h
+// Must be done before include
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h> // typedef uint8_t
+#include "fastio.h"
 // Check that uint8_t type exists
 #ifndef UINT8_MAX
 #error "No support for uint8_t"
 #endif
 
-static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                               "abcdefghijklmnopqrstuvwxyz"
-                               "0123456789+/=";
-                               
-
 // Encodes data from input file
-void encodeFile(FILE *in_file){
-    int i = 0;
-    uint8_t in[3], out[4];
+void encodeFile(int in_fd){
     /*
         # Citation for the following function:
         # Date: 04/11/2022
         # Adapted from: Code published by instructor Ryan Gambord on Ed
         # Source URL: https://edstem.org/us/courses/21025/discussion/1382259
     */
-    while(1){
-        size_t nread = 0;
-        i = i + 4;
-        for(size_t offset = 0; offset < sizeof in;){
-            size_t n = fread(in, sizeof(uint8_t), 3, in_file);
-            if(n == 0){
-                // end of input, partially filled input buffer
-                break;
-            }
-            offset += n;
-            nread = offset / sizeof *in;
-        }
-        if (nread == 0){
-            if(i == 4){
-                fprintf(stdout, "Error: file/stdin read fail");
-            }
-            // Reached eof and have no input to process
-            break;
+    struct fioReader reader;
+    struct fioWriter writer;
+    fioReaderOpen(&reader, in_fd, 0, 1);
+    fioWriterOpen(&writer, STDOUT_FILENO, 0);
+    unsigned long total = 0; // Groups written so far
+    unsigned column = 0; // Groups on the current line
+    uint8_t carry[3]; // A group split between two reads
+    size_t carried = 0;
+    size_t avail;
+    const uint8_t* in;
+    while(in = (const uint8_t*)fioWindow(&reader, &avail), avail > 0){
+        size_t used = 0;
+        while(carried > 0 && carried < 3 && used < avail){
+            carry[carried++] = in[used++];
         }
-        if(nread == 1){
-            // Read returned only one byte - eof encountered
-            out[0] = in[0] >> 2;
-            out[1] = ((in[0] & 0x03) << 4) | (in[1] >> 8);
-            fprintf(stdout, "%c%c==", alphabet[out[0]], alphabet[out[1]]);
+        if(carried == 3){
+            fioCommit(&writer, fioB64Encode(carry, 1, &column, fioReserve(&writer, 5)));
+            total++;
+            carried = 0;
         }
-        else if(nread == 2){
-            // Read returned only two bytes - eof encountered
-            out[0] = in[0] >> 2;
-            out[1] = ((in[0] & 0x03) << 4) | (in[1] >> 4);
-            out[2] = ((in[1] & 0x0F) << 2) | (in[2] >> 8);
-            fprintf(stdout, "%c%c%c=", alphabet[out[0]], alphabet[out[1]], alphabet[out[2]]);
-        }
-        else{
-            // Read returned the appropriate 3 bytes
-            out[0] = in[0] >> 2;
-            out[1] = ((in[0] & 0x03) << 4) | (in[1] >> 4);
-            out[2] = ((in[1] & 0x0F) << 2) | (in[2] >> 6);
-            out[3] = in[2] & 0x3F;
-            for(int j = 0; j < 4; ++j){
-                fprintf(stdout, "%c", alphabet[out[j]]);
+        // Encode up to a line at a time straight into the output buffer
+        while(avail - used >= 3){
+            size_t groups = (avail - used) / 3;
+            size_t lineLeft = FIO_B64_LINE - column;
+            if(groups > lineLeft){
+                groups = lineLeft;
             }
+            fioCommit(&writer, fioB64Encode(in + used, groups, &column, fioReserve(&writer, groups * 4 + 1)));
+            total += groups;
+            used += groups * 3;
+        }
+        while(used < avail){
+            carry[carried++] = in[used++];
         }
-        if((i % 76) == 0){
-            fprintf(stdout, "\n");
+        fioConsume(&reader, avail);
+    }
+    if(carried > 0){
+        // Reads ended one or two bytes into a group - eof encountered
+        fioCommit(&writer, fioB64Tail(carry, carried, fioReserve(&writer, 4)));
+        total++;
+        if(++column == FIO_B64_LINE){
+            fioPutc(&writer, '\n');
         }
     }
-    fprintf(stdout, "\n");
+    if(total == 0){
+        fioPrintf(&writer, "Error: file/stdin read fail");
+    }
+    fioPutc(&writer, '\n');
+    fioWriterClose(&writer);
+    fioReaderClose(&reader);
 }
 
 int main(int argc, char *argv[]) {
@@ -90,19 +91,19 @@ int main(int argc, char *argv[]) {
         # Date: 04/11/2022
         # Adapted from: Code published by instructor Ryan Gambord on teams
     */
-    FILE *in_file = stdin; // Get file or stdin when no file provided as arg
+    int in_fd = STDIN_FILENO; // Get file or stdin when no file provided as arg
     if(argc > 2){
         fprintf(stderr, "Error: invalid number of arguments\n");
         return -1;
     }
     if(argc > 1 && *argv[1] != '-'){
-        in_file = fopen(argv[1],"r");
-        if(in_file == NULL) {
+        in_fd = open(argv[1], O_RDONLY);
+        if(in_fd == -1) {
             fprintf(stderr, "ERROR: cannot open input file\n");
             return -1;
         }
     }
-    encodeFile(in_file);
-    fclose(in_file);
+    encodeFile(in_fd);
+    close(in_fd);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,709 @@
+/*
+    # Description: Shared buffered I/O for base64enc, archive and line_processor
+    # Requirements:
+    Read through large page aligned buffers, or straight out of a mapping when the input is a regular file.
+    Write through a large buffer, sending big blocks together with what is buffered in one writev().
+    Copy data that is passed through unchanged with copy_file_range() or splice(), falling back to
+    read() and write() where the kernel cannot do it.
+    Encode or decode base64 as a layer of a writer or reader, so armored data streams in constant memory.
+    Every function is static inline, so each tool compiles its own copy and no library has to be linked.
+    The including file must define _GNU_SOURCE before its first #include.
+*/
+
+#ifndef FASTIO_H
+#define FASTIO_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define FIO_BUF_SIZE (1 << 17) // Default reader and writer buffer size
+#define FIO_ALIGN 4096 // Buffers start on a page
+#define FIO_COPY_MAX (1 << 30) // Largest single copy_file_range() or splice() request
+#define FIO_B64_LINE 19 // Base64 groups per 76 character line
+
+/*
+Function that allocates a page aligned buffer, exiting if memory runs out
+*/
+static inline void* fioAlloc(size_t size){
+    void* p = NULL;
+    if(posix_memalign(&p, FIO_ALIGN, size ? size : 1)){
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+Function that reads once from fd, retrying when interrupted
+Returns the number of bytes read, 0 at end of file, or -1 on error.
+*/
+static inline ssize_t fioReadFd(int fd, void* buf, size_t n){
+    while(1){
+        ssize_t got = read(fd, buf, n);
+        if(got >= 0 || errno != EINTR){
+            return got;
+        }
+    }
+}
+
+/*
+Function that writes all of a set of buffers to fd, retrying short writes
+Returns 0, or -1 on error with errno set.
+*/
+static inline int fioWritevAll(int fd, struct iovec* iov, int count){
+    while(count > 0){
+        ssize_t w = writev(fd, iov, count);
+        if(w < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        // Drop what was written, the first buffer left may be partly done
+        while(count > 0 && (size_t)w >= iov->iov_len){
+            w -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if(count > 0){
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/*
+Function that writes all of a buffer to fd, retrying short writes
+Returns 0, or -1 on error with errno set.
+*/
+static inline int fioWriteAll(int fd, const void* p, size_t n){
+    struct iovec iov = {(void*)p, n};
+    return fioWritevAll(fd, &iov, 1);
+}
+
+/*
+Function that maps fd for reading if it is a non-empty regular file, from its current offset to its end
+Returns the mapping, or NULL when fd has to be read instead. *len is set to the mapped length.
+*/
+static inline char* fioMap(int fd, size_t* len){
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    // Mappings start on a page, so only map from the start of the file
+    if(offset != 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0){
+        return NULL;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED){
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *len = st.st_size;
+    return map;
+}
+
+/*
+Function that copies n bytes from the current offset of in to the current offset of out inside the
+kernel: copy_file_range() between files, splice() when either side is a pipe, and read() and write()
+through a buffer when neither works.
+Returns the number of bytes copied, short only at end of input, or -1 on error with errno set.
+*/
+static inline long long fioCopyFd(int in, int out, long long n){
+    long long done = 0;
+    int method = 0; // 0 copy_file_range, 1 splice, 2 buffer
+    char* buf = NULL;
+    while(done < n){
+        size_t want = n - done > FIO_COPY_MAX ? FIO_COPY_MAX : n - done;
+        ssize_t got;
+        if(method == 0){
+            got = copy_file_range(in, NULL, out, NULL, want, 0);
+        }
+        else if(method == 1){
+            got = splice(in, NULL, out, NULL, want, SPLICE_F_MOVE);
+        }
+        else{
+            if(buf == NULL){
+                buf = fioAlloc(FIO_BUF_SIZE);
+            }
+            got = fioReadFd(in, buf, want > FIO_BUF_SIZE ? FIO_BUF_SIZE : want);
+            if(got > 0 && fioWriteAll(out, buf, got)){
+                got = -1;
+            }
+        }
+        if(got < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            // Not supported between these two, try the next way, nothing has been copied by this call
+            if(method < 2 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)){
+                ++method;
+                continue;
+            }
+            free(buf);
+            return -1;
+        }
+        if(got == 0){
+            break;
+        }
+        done += got;
+    }
+    free(buf);
+    return done;
+}
+
+/*
+Base64
+The RFC 4648 alphabet, 76 character lines.
+*/
+static const char fioB64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+Function that encodes whole 3 byte groups into out, ending the line after every FIO_B64_LINE groups.
+*column counts the groups already on the current line.
+Returns the number of characters written, at most groups * 4 + groups / FIO_B64_LINE + 1.
+*/
+static inline size_t fioB64Encode(const unsigned char* in, size_t groups, unsigned* column, char* out){
+    char* start = out;
+    for(size_t g = 0; g < groups; ++g, in += 3){
+        out[0] = fioB64Alphabet[in[0] >> 2];
+        out[1] = fioB64Alphabet[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+        out[2] = fioB64Alphabet[((in[1] & 0x0F) << 2) | (in[2] >> 6)];
+        out[3] = fioB64Alphabet[in[2] & 0x3F];
+        out += 4;
+        if(++*column == FIO_B64_LINE){
+            *out++ = '\n';
+            *column = 0;
+        }
+    }
+    return out - start;
+}
+
+/*
+Function that encodes the last 1 or 2 bytes of the data as one group padded with =
+Returns the number of characters written, 4.
+*/
+static inline size_t fioB64Tail(const unsigned char* in, size_t n, char* out){
+    unsigned char second = n > 1 ? in[1] : 0;
+    out[0] = fioB64Alphabet[in[0] >> 2];
+    out[1] = fioB64Alphabet[((in[0] & 0x03) << 4) | (second >> 4)];
+    out[2] = n > 1 ? fioB64Alphabet[(second & 0x0F) << 2] : '=';
+    out[3] = '=';
+    return 4;
+}
+
+/*
+Base64 decoder state carried between blocks
+*/
+struct fioB64State{
+    unsigned bits; // Sextets of the unfinished group
+    int count; // Number of them
+    int done; // Padding seen, the data has ended
+    int bad; // Input that is not base64
+};
+
+/*
+Function that decodes a block of base64 text into out, skipping line breaks and blanks. A group split
+between blocks is carried in st.
+Returns the number of bytes written, at most (len + 3) / 4 * 3.
+*/
+static inline size_t fioB64Decode(struct fioB64State* st, const char* in, size_t len, unsigned char* out){
+    unsigned char* start = out;
+    for(size_t i = 0; i < len; ++i){
+        char c = in[i];
+        int v;
+        if(c >= 'A' && c <= 'Z'){
+            v = c - 'A';
+        }
+        else if(c >= 'a' && c <= 'z'){
+            v = c - 'a' + 26;
+        }
+        else if(c >= '0' && c <= '9'){
+            v = c - '0' + 52;
+        }
+        else if(c == '+'){
+            v = 62;
+        }
+        else if(c == '/'){
+            v = 63;
+        }
+        else if(c == '\n' || c == '\r' || c == ' ' || c == '\t'){
+            continue;
+        }
+        else if(c == '=' && !st->done){
+            // Padding ends the data, what is left of the group holds 1 or 2 bytes
+            if(st->count == 2){
+                *out++ = st->bits >> 4;
+            }
+            else if(st->count == 3){
+                *out++ = st->bits >> 10;
+                *out++ = st->bits >> 2;
+            }
+            else{
+                st->bad = 1;
+            }
+            st->done = 1;
+            st->count = 0;
+            continue;
+        }
+        else if(c == '=' && st->done){
+            continue;
+        }
+        else{
+            st->bad = 1;
+            break;
+        }
+        if(st->done){
+            st->bad = 1;
+            break;
+        }
+        st->bits = (st->bits << 6) | v;
+        if(++st->count == 4){
+            out[0] = st->bits >> 16;
+            out[1] = st->bits >> 8;
+            out[2] = st->bits;
+            out += 3;
+            st->bits = 0;
+            st->count = 0;
+        }
+    }
+    return out - start;
+}
+
+/*
+Reader
+Unread input is data[pos..len). data is the whole mapping of a regular file, or the aligned buffer
+refilled by read() for anything else.
+*/
+struct fioReader{
+    int fd;
+    const char* data;
+    size_t pos;
+    size_t len;
+    char* buf;
+    size_t cap;
+    char* map; // Whole input when mapped, else NULL
+    size_t mapLen;
+    int eof;
+    int error; // errno of a failed read, EILSEQ for bad base64, 0 if none
+    char* raw; // Armored text waiting to be decoded, NULL when not armored
+    size_t rawCap;
+    struct fioB64State b64;
+};
+
+/*
+Function that sets up a reader on fd with a buffer of cap bytes, 0 for the default, mapping fd when
+map is set and it is a regular file
+*/
+static inline void fioReaderOpen(struct fioReader* r, int fd, size_t cap, int map){
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    if(map && (r->map = fioMap(fd, &r->mapLen)) != NULL){
+        r->data = r->map;
+        r->len = r->mapLen;
+        r->eof = 1;
+        return;
+    }
+    r->cap = cap ? cap : FIO_BUF_SIZE;
+    r->buf = fioAlloc(r->cap);
+    r->data = r->buf;
+}
+
+/*
+Function that releases a reader's buffer or mapping, the descriptor stays open
+*/
+static inline void fioReaderClose(struct fioReader* r){
+    if(r->map){
+        munmap(r->map, r->mapLen);
+    }
+    free(r->buf);
+    free(r->raw);
+    r->map = r->buf = r->raw = NULL;
+}
+
+/*
+Function that makes a reader decode base64 from its input. Call it before anything is read, on a
+reader opened without a mapping.
+*/
+static inline void fioReaderArmor(struct fioReader* r){
+    // Sized so one read of text always decodes into the buffer
+    r->rawCap = r->cap / 3 * 4 - 4;
+    r->raw = fioAlloc(r->rawCap);
+    memset(&r->b64, 0, sizeof(r->b64));
+}
+
+/*
+Function that refills an armored reader's window by reading and decoding text until some bytes come out
+Returns the number of bytes available, 0 at end of input or on error.
+*/
+static inline size_t fioFillArmor(struct fioReader* r){
+    r->pos = 0;
+    r->len = 0;
+    while(r->len == 0 && !r->eof){
+        ssize_t got = fioReadFd(r->fd, r->raw, r->rawCap);
+        if(got <= 0){
+            r->eof = 1;
+            r->error = got < 0 ? errno : 0;
+            // A last group without padding
+            if(got == 0 && r->b64.count > 1){
+                r->len = fioB64Decode(&r->b64, "==", 4 - r->b64.count, (unsigned char*)r->buf);
+            }
+            else if(got == 0 && r->b64.count == 1){
+                r->error = EILSEQ;
+            }
+            break;
+        }
+        r->len = fioB64Decode(&r->b64, r->raw, got, (unsigned char*)r->buf);
+        if(r->b64.bad){
+            r->eof = 1;
+            r->error = EILSEQ;
+        }
+    }
+    return r->len;
+}
+
+/*
+Function that makes sure some unread input is in the window, reading more if it is empty
+Returns the number of bytes available, 0 at end of input or on error.
+*/
+static inline size_t fioFill(struct fioReader* r){
+    if(r->pos < r->len || r->eof){
+        return r->len - r->pos;
+    }
+    if(r->raw){
+        return fioFillArmor(r);
+    }
+    ssize_t got = fioReadFd(r->fd, r->buf, r->cap);
+    if(got <= 0){
+        r->eof = 1;
+        r->error = got < 0 ? errno : 0;
+        got = 0;
+    }
+    r->pos = 0;
+    r->len = got;
+    return got;
+}
+
+/*
+Function that returns the unread input in the window without consuming it, filling it if empty
+*/
+static inline const char* fioWindow(struct fioReader* r, size_t* avail){
+    *avail = fioFill(r);
+    return r->data + r->pos;
+}
+
+/*
+Function that consumes n bytes of the window
+*/
+static inline void fioConsume(struct fioReader* r, size_t n){
+    r->pos += n;
+}
+
+/*
+Function that reads one byte
+Returns the byte, or EOF at end of input.
+*/
+static inline int fioGetc(struct fioReader* r){
+    if(r->pos == r->len && fioFill(r) == 0){
+        return EOF;
+    }
+    return (unsigned char)r->data[r->pos++];
+}
+
+/*
+Function that reads up to n bytes into dst. Once the window is used up, large reads go straight into
+dst instead of through the buffer.
+Returns the number of bytes read, less than n only at end of input.
+*/
+static inline size_t fioRead(struct fioReader* r, void* dst, size_t n){
+    size_t done = 0;
+    while(done < n){
+        size_t avail = r->len - r->pos;
+        if(avail == 0 && !r->eof && !r->raw && n - done >= r->cap){
+            ssize_t got = fioReadFd(r->fd, (char*)dst + done, n - done);
+            if(got <= 0){
+                r->eof = 1;
+                r->error = got < 0 ? errno : 0;
+                break;
+            }
+            done += got;
+            continue;
+        }
+        if(avail == 0 && (avail = fioFill(r)) == 0){
+            break;
+        }
+        size_t take = avail < n - done ? avail : n - done;
+        memcpy((char*)dst + done, r->data + r->pos, take);
+        r->pos += take;
+        done += take;
+    }
+    return done;
+}
+
+/*
+Function that passes n bytes of input through to fd unchanged: the window is written out first, a
+mapping is written straight from the mapping, and the rest of a read() input is copied by the kernel
+with fioCopyFd(), since nothing past the window has been read yet. Armored input is decoded and
+written a window at a time.
+Returns the number of bytes written, less than n at end of input, or -1 on a write error.
+*/
+static inline long long fioCopy(struct fioReader* r, int fd, long long n){
+    long long done = 0;
+    size_t avail = r->len - r->pos;
+    if(avail > 0){
+        size_t take = (long long)avail < n ? avail : (size_t)n;
+        if(fioWriteAll(fd, r->data + r->pos, take)){
+            return -1;
+        }
+        r->pos += take;
+        done = take;
+    }
+    while(r->raw && done < n){
+        size_t avail;
+        const char* p = fioWindow(r, &avail);
+        if(avail == 0){
+            return done;
+        }
+        size_t take = (long long)avail < n - done ? avail : (size_t)(n - done);
+        if(fioWriteAll(fd, p, take)){
+            return -1;
+        }
+        fioConsume(r, take);
+        done += take;
+    }
+    if(done == n || r->eof){
+        return done;
+    }
+    long long copied = fioCopyFd(r->fd, fd, n - done);
+    if(copied < 0){
+        return -1;
+    }
+    if(copied < n - done){
+        r->eof = 1;
+    }
+    return done + copied;
+}
+
+/*
+Writer
+Small writes are gathered in an aligned buffer. A write too big to be worth copying goes out with the
+buffered bytes in front of it in one writev().
+*/
+struct fioWriter{
+    int fd;
+    char* buf;
+    size_t cap;
+    size_t len;
+    int error; // errno of the first failed write, 0 if none
+    char* coded; // Base64 text of a flushed buffer, NULL when not armored
+    unsigned column; // Groups on the current base64 line
+};
+
+/*
+Function that sets up a writer on fd with a buffer of cap bytes, 0 for the default
+*/
+static inline void fioWriterOpen(struct fioWriter* w, int fd, size_t cap){
+    w->fd = fd;
+    w->cap = cap ? cap : FIO_BUF_SIZE;
+    w->buf = fioAlloc(w->cap);
+    w->len = 0;
+    w->error = 0;
+    w->coded = NULL;
+    w->column = 0;
+}
+
+/*
+Function that makes a writer encode everything written to it as base64 lines. Call it before anything
+is written.
+*/
+static inline void fioWriterArmor(struct fioWriter* w){
+    w->coded = fioAlloc(w->cap / 3 * 4 + w->cap / 3 / FIO_B64_LINE + 16);
+}
+
+/*
+Function that writes out everything buffered
+Returns 0, or -1 if this or an earlier write failed.
+*/
+static inline int fioFlush(struct fioWriter* w){
+    if(w->coded){
+        // Encode whole groups, the last 1 or 2 bytes wait for more data or the close
+        size_t whole = w->len / 3 * 3;
+        size_t n = fioB64Encode((unsigned char*)w->buf, whole / 3, &w->column, w->coded);
+        if(n > 0 && !w->error && fioWriteAll(w->fd, w->coded, n)){
+            w->error = errno;
+        }
+        memmove(w->buf, w->buf + whole, w->len - whole);
+        w->len -= whole;
+        return w->error ? -1 : 0;
+    }
+    if(w->len > 0 && !w->error && fioWriteAll(w->fd, w->buf, w->len)){
+        w->error = errno;
+    }
+    w->len = 0;
+    return w->error ? -1 : 0;
+}
+
+/*
+Function that writes n bytes
+Returns 0, or -1 if a write has failed.
+*/
+static inline int fioWrite(struct fioWriter* w, const void* p, size_t n){
+    if(n <= w->cap - w->len){
+        memcpy(w->buf + w->len, p, n);
+        w->len += n;
+        return w->error ? -1 : 0;
+    }
+    // Armored data has to pass through the buffer to be encoded
+    while(w->coded && n > 0){
+        size_t take = w->cap - w->len < n ? w->cap - w->len : n;
+        memcpy(w->buf + w->len, p, take);
+        w->len += take;
+        p = (const char*)p + take;
+        n -= take;
+        if(w->len == w->cap && fioFlush(w)){
+            return -1;
+        }
+    }
+    if(w->coded){
+        return w->error ? -1 : 0;
+    }
+    if(n < w->cap / 2){
+        // Top up the buffer, send it, and start the next one with the rest
+        size_t first = w->cap - w->len;
+        memcpy(w->buf + w->len, p, first);
+        w->len = w->cap;
+        if(fioFlush(w)){
+            return -1;
+        }
+        memcpy(w->buf, (const char*)p + first, n - first);
+        w->len = n - first;
+        return 0;
+    }
+    struct iovec iov[2] = {{w->buf, w->len}, {(void*)p, n}};
+    if(!w->error && fioWritevAll(w->fd, iov + (w->len == 0), 2 - (w->len == 0))){
+        w->error = errno;
+    }
+    w->len = 0;
+    return w->error ? -1 : 0;
+}
+
+/*
+Function that returns room for at least n bytes at the end of the buffer, flushing it if needed.
+n must not be more than the buffer size, less 2 for an armored writer. The bytes count once fioCommit()
+is called.
+*/
+static inline char* fioReserve(struct fioWriter* w, size_t n){
+    if(w->cap - w->len < n){
+        fioFlush(w);
+    }
+    return w->buf + w->len;
+}
+
+static inline void fioCommit(struct fioWriter* w, size_t n){
+    w->len += n;
+}
+
+/*
+Function that writes one byte
+*/
+static inline int fioPutc(struct fioWriter* w, int c){
+    if(w->len == w->cap && fioFlush(w)){
+        return -1;
+    }
+    w->buf[w->len++] = c;
+    return 0;
+}
+
+/*
+Function that writes formatted text, formatting straight into the buffer when it fits
+Returns the number of bytes written, or -1 if a write has failed.
+*/
+static inline int fioPrintf(struct fioWriter* w, const char* format, ...){
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(w->buf + w->len, w->cap - w->len, format, ap);
+    va_end(ap);
+    if(n < 0){
+        return -1;
+    }
+    if((size_t)n < w->cap - w->len){
+        w->len += n;
+        return w->error ? -1 : n;
+    }
+    // Did not fit, format into a buffer of its own
+    char* text = malloc(n + 1);
+    va_start(ap, format);
+    vsnprintf(text, n + 1, format, ap);
+    va_end(ap);
+    int failed = fioWrite(w, text, n);
+    free(text);
+    return failed ? -1 : n;
+}
+
+/*
+Function that passes n bytes from the current offset of fd through to the writer's descriptor, after
+what is already buffered. An armored writer reads them into its buffer to be encoded instead.
+Returns the number of bytes copied, short if fd ends first, or -1 on a write error.
+*/
+static inline long long fioSplice(struct fioWriter* w, int fd, long long n){
+    if(w->coded){
+        long long done = 0;
+        while(done < n){
+            if(w->len == w->cap && fioFlush(w)){
+                return -1;
+            }
+            size_t room = w->cap - w->len;
+            ssize_t got = fioReadFd(fd, w->buf + w->len, (long long)room < n - done ? room : (size_t)(n - done));
+            if(got <= 0){
+                break;
+            }
+            w->len += got;
+            done += got;
+        }
+        return w->error ? -1 : done;
+    }
+    if(fioFlush(w)){
+        return -1;
+    }
+    long long copied = fioCopyFd(fd, w->fd, n);
+    if(copied < 0){
+        w->error = errno;
+    }
+    return copied;
+}
+
+/*
+Function that flushes a writer and frees its buffer, the descriptor stays open
+Returns 0, or -1 if any write failed.
+*/
+static inline int fioWriterClose(struct fioWriter* w){
+    int failed = fioFlush(w);
+    if(w->coded){
+        // Pad the last group and end the last line
+        size_t n = 0;
+        if(w->len > 0){
+            n = fioB64Tail((unsigned char*)w->buf, w->len, w->coded);
+            w->column++;
+        }
+        if(w->column > 0){
+            w->coded[n++] = '\n';
+        }
+        if(n > 0 && !failed && fioWriteAll(w->fd, w->coded, n)){
+            failed = -1;
+        }
+        free(w->coded);
+        w->coded = NULL;
+    }
+    free(w->buf);
+    w->buf = NULL;
+    return failed;
+}
+
+#endif
@@ -13,12 +13,60 @@
     Thread 4, called the Output Thread, write this processed data to standard output as lines of exactly 80 characters.
 
     Furthermore, in your program these 4 threads must communicate with each other using the Producer-Consumer approach. 
+
+    Output is collected into batches of 80 character lines and written with one write per batch.
+    A batch is flushed when it is full and, depending on -f, when the output stage runs out of work (idle),
+    only when full (batch), or once its oldest line has waited -t milliseconds (timer). The classic
+    threads' input stage holds the lock while it reads, so there the timer is checked as lines arrive.
+
+    Streaming mode (-s) runs the same four stages over chunks taken from a fixed pool instead of the
+    fixed size buffers above, so lines of any length and input of any size are handled in bounded memory.
+    It stops on a STOP line or at end of input. Input is read in large blocks of many lines, from a mapping
+    when standard input is a regular file, and a leading newline stage is done during that same pass.
+    The stages between input and output are pluggable, -P takes a comma separated list of registered
+    stages (newline, plus, ctrl, tabs) and defaults to "newline,plus".
+
+    Data-parallel mode (-p N) reads the input in large blocks and lets N worker threads replace line
+    separators and plus signs in different blocks at the same time. The blocks are put back together in
+    order, fixing up plus signs that meet across a block edge, and cut into 80 character lines.
+
+    -X runs a benchmark and correctness harness over every mode with generated input instead of reading
+    standard input, see benchMain().
 */
 
+// Needed for memrchr()
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "fastio.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define CHUNK_SIZE 65536 // Payload bytes per streaming chunk
+#define CHUNK_HEADROOM 16 // Spare bytes in front of each chunk so a stage can prepend carried data
+#define POOL_CHUNKS 16 // Chunks shared by all streaming stages, bounds memory use
+#define FLUSH_SLACK 16 // Bytes kept free at the end of each chunk for stage flush hooks
+#define MAX_STAGES 32
+#define BATCH_LINES 512 // Default number of 80 character lines written per output batch
+#define PAR_CHUNK (1 << 20) // Bytes per block in data-parallel mode
+#define MAX_WORKERS 256
+#define QUEUE_DEPTH 4 // Chunks a stage may queue for the next one before it has to wait
+#define MAX_STATS (MAX_STAGES + MAX_WORKERS + 2)
+#define LAT_SUB 8 // Latency histogram buckets per power of two
+#define LAT_BUCKETS (64 * LAT_SUB)
+#define MAX_BATCH_SAMPLES 64
 
 // Initialize buffers
 char input[1000]; // For intiial input from user
@@ -37,36 +85,341 @@ pthread_cond_t sub = PTHREAD_COND_INITIALIZER;
 pthread_cond_t out = PTHREAD_COND_INITIALIZER;
 
 /*
-Function for replacing ++ with ^
+Function that finds the next '+' in [p, end), comparing 16 bytes at a time where SSE2 is available
 */
-char* plusSignReplace(char* line){
-    // Get first instance location of ++
-    char* substring = strstr(seperateLines, "++");
-    // No instances of ++
-    if(substring == NULL){
-        return NULL;
+const char* findPlus(const char* p, const char* end){
+#if defined(__SSE2__)
+    const __m128i plus = _mm_set1_epi8('+');
+    while(end - p >= 16){
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), plus));
+        if(mask){
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    return memchr(p, '+', end - p);
+}
+
+/*
+Function that replaces every "++" with "^" in a single pass from src into dst and returns the number
+of bytes written. dst may be src itself, or one byte in front of src when *pending is set.
+A '+' at the end of src is carried in *pending for the next call unless final is set.
+*/
+size_t plusReplaceKernel(int* pending, const char* src, size_t len, char* dst, int final){
+    const char* p = src;
+    const char* end = src + len;
+    size_t w = 0;
+    if(*pending){
+        if(len == 0 && !final){
+            return 0;
+        }
+        if(len > 0 && *p == '+'){
+            dst[w++] = '^';
+            ++p;
+        }
+        else{
+            dst[w++] = '+';
+        }
+        *pending = 0;
     }
-    int subLen = strlen(substring) - 1;
+    while(p < end){
+        const char* q = findPlus(p, end);
+        if(q == NULL){
+            q = end;
+        }
+        // Copy the run without plus signs, dst never passes the bytes still to be read
+        if(dst + w != p){
+            memmove(dst + w, p, q - p);
+        }
+        w += q - p;
+        p = q;
+        if(p == end){
+            break;
+        }
+        if(p + 1 < end){
+            if(p[1] == '+'){
+                dst[w++] = '^';
+                p += 2;
+            }
+            else{
+                dst[w++] = '+';
+                ++p;
+            }
+        }
+        else if(final){
+            dst[w++] = '+';
+            ++p;
+        }
+        else{
+            *pending = 1;
+            ++p;
+        }
+    }
+    return w;
+}
+
+/*
+Instrumentation
+Every pipeline thread owns one block of counters and is the only writer of it, so
+the counting needs no locks. A dump, at exit with -S or on SIGUSR1, reads them with relaxed atomics.
+With -L N, every Nth chunk of the streaming or data-parallel modes is timed from input read to output write into a latency histogram.
+*/
+#define STAT_ADD(field, v) __atomic_fetch_add(&(field), (v), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STAT_SET(field, v) __atomic_store_n(&(field), (v), __ATOMIC_RELAXED)
 
-    // Adapted from CodeVault's "Replace substrings"
-    // Adjust space at ++ to size of ^
-    memmove(substring + 1, substring + 2, subLen);
-    // Copy ^ into the string at the location of ++
-    memcpy(substring, "^", 1);
+struct stageStats{
+    char name[32];
+    unsigned long long bytesIn;
+    unsigned long long bytesOut;
+    unsigned long long items; // Chunks or blocks handled
+    unsigned long long blockedFull; // Nanoseconds waiting for room downstream
+    unsigned long long blockedEmpty; // Nanoseconds waiting for input
+    unsigned long long wakeups; // Returns from condition variable waits
+    unsigned long long started; // Monotonic nanoseconds when the thread started
+    unsigned long long finished; // Monotonic nanoseconds when it finished, 0 while running
+    const size_t* highWater; // Deepest the stage's input queue has been, NULL if it has none
+};
 
-    // Return non-NULL value
-    return substring;
+struct stageStats* statsTable[MAX_STATS];
+int statsCount = 0;
+pthread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+FILE* statsOut = NULL; // Where -S sends the dump, stderr is used for SIGUSR1 without -S
+const char* runMode = "classic";
+
+unsigned long long latencyHist[LAT_BUCKETS]; // Microseconds, LAT_SUB buckets per power of two
+unsigned long long latencySamples = 0;
+int sampleEvery = 0; // Time every Nth chunk, 0 turns sampling off
+
+/*
+Function that reads the monotonic clock in nanoseconds
+*/
+unsigned long long monoNs(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /*
-Function that formats and prints out, then trims the buffer to remove printed data
+Function that creates and registers the counters for one thread
 */
-void printFormat(char* replacedString){
-    fprintf(stdout, "%.80s\n", replacedString);
-    fflush(stdout);
-    // Remove output from buffer
-    memmove(replacedString, replacedString + 80, strlen(replacedString) - 79);
-    memcpy(replacedString, "", 0);
+struct stageStats* statsNew(const char* name){
+    struct stageStats* st = calloc(1, sizeof(struct stageStats));
+    snprintf(st->name, sizeof(st->name), "%s", name);
+    st->started = monoNs();
+    pthread_mutex_lock(&statsMutex);
+    if(statsCount < MAX_STATS){
+        statsTable[statsCount++] = st;
+    }
+    pthread_mutex_unlock(&statsMutex);
+    return st;
+}
+
+/*
+Function that waits on a condition variable, charging the wait and the wakeup to the thread's counters
+*/
+int statWait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* deadline, struct stageStats* st, unsigned long long* blocked){
+    if(st == NULL){
+        return deadline ? pthread_cond_timedwait(cond, mutex, deadline) : pthread_cond_wait(cond, mutex);
+    }
+    unsigned long long start = monoNs();
+    int ret = deadline ? pthread_cond_timedwait(cond, mutex, deadline) : pthread_cond_wait(cond, mutex);
+    STAT_ADD(*blocked, monoNs() - start);
+    STAT_ADD(st->wakeups, 1);
+    return ret;
+}
+
+/*
+Function that adds one end to end latency to the histogram
+*/
+void latencyRecord(unsigned long long ns){
+    unsigned long long us = ns / 1000;
+    int bucket = us;
+    if(us >= LAT_SUB){
+        int shift = 63 - __builtin_clzll(us) - 3;
+        bucket = (shift + 1) * LAT_SUB + (int)((us >> shift) - LAT_SUB);
+    }
+    STAT_ADD(latencyHist[bucket], 1);
+    STAT_ADD(latencySamples, 1);
+}
+
+/*
+Function that gives the largest latency in microseconds that falls in a histogram bucket
+*/
+unsigned long long latencyUpper(int bucket){
+    if(bucket < LAT_SUB){
+        return bucket;
+    }
+    int shift = bucket / LAT_SUB - 1;
+    return ((unsigned long long)(bucket % LAT_SUB + LAT_SUB + 1) << shift) - 1;
+}
+
+/*
+Function that estimates a latency percentile from the histogram, as a bucket upper bound
+*/
+unsigned long long latencyPercentile(double p){
+    unsigned long long total = STAT_GET(latencySamples);
+    unsigned long long seen = 0;
+    for(int i = 0; i < LAT_BUCKETS; ++i){
+        seen += STAT_GET(latencyHist[i]);
+        if(total > 0 && seen >= p * total){
+            return latencyUpper(i);
+        }
+    }
+    return 0;
+}
+
+/*
+Function that writes every thread's counters and the latency histogram as one line of JSON
+*/
+void statsDump(FILE* f, const char* event){
+    unsigned long long now = monoNs();
+    pthread_mutex_lock(&statsMutex);
+    fprintf(f, "{\"event\":\"%s\",\"mode\":\"%s\",\"stages\":[", event, runMode);
+    for(int i = 0; i < statsCount; ++i){
+        struct stageStats* st = statsTable[i];
+        unsigned long long end = STAT_GET(st->finished);
+        double run = ((end ? end : now) - st->started) / 1e6;
+        double full = STAT_GET(st->blockedFull) / 1e6;
+        double empty = STAT_GET(st->blockedEmpty) / 1e6;
+        fprintf(f, "%s{\"name\":\"%s\",\"bytes_in\":%llu,\"bytes_out\":%llu,\"items\":%llu,"
+                   "\"run_ms\":%.3f,\"blocked_full_ms\":%.3f,\"blocked_empty_ms\":%.3f,\"utilization\":%.3f,\"wakeups\":%llu",
+                i ? "," : "", st->name, STAT_GET(st->bytesIn), STAT_GET(st->bytesOut), STAT_GET(st->items),
+                run, full, empty, run > 0 ? 1 - (full + empty) / run : 0, STAT_GET(st->wakeups));
+        if(st->highWater){
+            fprintf(f, ",\"queue_high_water\":%zu", __atomic_load_n(st->highWater, __ATOMIC_RELAXED));
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "]");
+    if(sampleEvery){
+        fprintf(f, ",\"latency_us\":{\"samples\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"buckets\":[",
+                STAT_GET(latencySamples), latencyPercentile(0.5), latencyPercentile(0.9), latencyPercentile(0.99));
+        int first = 1;
+        for(int i = 0; i < LAT_BUCKETS; ++i){
+            unsigned long long n = STAT_GET(latencyHist[i]);
+            if(n){
+                fprintf(f, "%s[%llu,%llu]", first ? "" : ",", latencyUpper(i), n);
+                first = 0;
+            }
+        }
+        fprintf(f, "]}");
+    }
+    fprintf(f, "}\n");
+    fflush(f);
+    pthread_mutex_unlock(&statsMutex);
+}
+
+/*
+Thread that dumps the counters each time SIGUSR1 arrives. The signal is blocked in every other thread.
+*/
+void *statsSignalThread(void *args){
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    int sig;
+    while(sigwait(&set, &sig) == 0){
+        statsDump(statsOut ? statsOut : stderr, "signal");
+    }
+    return NULL;
+}
+
+// When to write out a partly filled output batch
+enum flushPolicy{FLUSH_IDLE, FLUSH_BATCH, FLUSH_TIMER};
+enum flushPolicy flushPolicy = FLUSH_IDLE;
+long flushMillis = 0; // Latency bound for FLUSH_TIMER
+size_t batchLines = BATCH_LINES;
+
+/*
+Output batch, 80 character lines with their newlines collected for a single write
+*/
+struct outBatch{
+    char* buf; // batchLines lines of 81 bytes
+    size_t lines; // Lines currently held
+    struct timespec since; // When the oldest held line was added
+    struct stageStats* stats; // Counters of the writing thread, may be NULL
+    unsigned long long born[MAX_BATCH_SAMPLES]; // Read times of sampled chunks waiting in the batch
+    int sampled;
+};
+
+/*
+Function that writes all of a buffer to standard output, exiting if the write fails
+*/
+void writeAll(const char* p, size_t n){
+    if(fioWriteAll(STDOUT_FILENO, p, n)){
+        perror("write");
+        exit(1);
+    }
+}
+
+/*
+Function that writes out every line held in the batch
+*/
+void batchFlush(struct outBatch* b){
+    writeAll(b->buf, b->lines * 81);
+    if(b->stats){
+        STAT_ADD(b->stats->bytesOut, b->lines * 81);
+    }
+    b->lines = 0;
+    if(b->sampled){
+        unsigned long long now = monoNs();
+        for(int i = 0; i < b->sampled; ++i){
+            latencyRecord(now - b->born[i]);
+        }
+        b->sampled = 0;
+    }
+}
+
+/*
+Function that returns when the oldest line held in the batch is due under FLUSH_TIMER
+*/
+struct timespec batchDeadline(const struct outBatch* b){
+    struct timespec deadline = b->since;
+    deadline.tv_sec += flushMillis / 1000;
+    deadline.tv_nsec += (flushMillis % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000){
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+/*
+Function that tells whether the batch should be written now under FLUSH_TIMER
+*/
+int batchDue(const struct outBatch* b){
+    struct timespec deadline = batchDeadline(b);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+/*
+Function that notes a sampled chunk whose data is now in the batch, so its latency is taken when the
+batch is written
+*/
+void batchSample(struct outBatch* b, unsigned long long born){
+    if(b->sampled == MAX_BATCH_SAMPLES){
+        latencyRecord(monoNs() - born);
+        return;
+    }
+    b->born[b->sampled++] = born;
+}
+
+/*
+Function that formats one 80 character line into the batch, writing the batch out once it is full
+*/
+void printFormat(struct outBatch* b, const char* line){
+    if(b->lines == 0){
+        clock_gettime(CLOCK_REALTIME, &b->since);
+    }
+    char* dst = b->buf + b->lines * 81;
+    memcpy(dst, line, 80);
+    dst[80] = '\n';
+    if(++b->lines == batchLines){
+        batchFlush(b);
+    }
     // Increment linecounter
     ++lineCounter;
 }
@@ -75,23 +428,31 @@ void printFormat(char* replacedString){
  Function that the input producer thread will run. Produce an input string. Put in the buffer only when there is space in the buffer. If the buffer is full, then wait until there is space in the buffer.
 */
 void *inputThread(void *args){
+    struct stageStats* st = args;
     memset(input, 0, sizeof(input));
     while(1){
         // Lock mutex before checking
         pthread_mutex_lock(&mutex);
         while(strlen(input) > 0){
             // Buffer is full. Wait for the consumer to signal that the buffer is empty
-            pthread_cond_wait(&empty, &mutex);
+            statWait(&empty, &mutex, NULL, st, &st->blockedFull);
         }
-        // Get user input
-        fgets(input, 1000, stdin);
-        input[strlen(input) - 1] = 0;
-        if(!(strcmp(input, "STOP")) || lineCounter == 49){
+        // Get user input, end of input counts as STOP
+        if(fgets(input, 1000, stdin) == NULL){
+            strcpy(input, "STOP\n");
+        }
+        // The line separator is kept so an empty line still fills the buffer
+        if(!strcmp(input, "STOP\n") || !strcmp(input, "STOP") || lineCounter == 49){
             // STOP or output limit has been received
             pthread_cond_signal(&full);
             pthread_mutex_unlock(&mutex);
+            STAT_SET(st->finished, monoNs());
             return NULL;
         }
+        size_t len = strlen(input);
+        STAT_ADD(st->bytesIn, len);
+        STAT_ADD(st->bytesOut, len);
+        STAT_ADD(st->items, 1);
         // Signal to the consumer that the buffer is no longer empty
         pthread_cond_signal(&full);
         // Unlock the mutex
@@ -103,19 +464,27 @@ void *inputThread(void *args){
  Function that the consumer input thread will run. Get strings from the buffer if the buffer is >= 80 char. If the buffer is < 80 char then wait until there is data in the buffer.
 */
 void *lineSeparatorThread(void *args){
+    struct stageStats* st = args;
     memset(seperateLines, 0, sizeof(seperateLines));
     while(1){
         // Lock the mutex before checking if the input buffer has data
         pthread_mutex_lock(&mutex);
         while(strlen(input) == 0){
             // Buffer is empy
-            pthread_cond_wait(&full, &mutex);
+            statWait(&full, &mutex, NULL, st, &st->blockedEmpty);
         }
-        if(!strcmp(input, "STOP") || lineCounter == 49){
+        if(!strcmp(input, "STOP\n") || !strcmp(input, "STOP") || lineCounter == 49){
             break;
         }
+        // Replace the line separator with a space
+        size_t len = strlen(input);
+        if(input[len - 1] == '\n'){
+            input[len - 1] = ' ';
+        }
         strcat(seperateLines, input);
-        strcat(seperateLines, " ");
+        STAT_ADD(st->bytesIn, len);
+        STAT_ADD(st->bytesOut, len);
+        STAT_ADD(st->items, 1);
         memset(input, 0, sizeof(input));
         // Signal to plusSignThread that seperateLines buffer has input
         pthread_cond_signal(&sub);
@@ -129,20 +498,28 @@ void *lineSeparatorThread(void *args){
     pthread_cond_signal(&sub);
     // Unlock the mutex
     pthread_mutex_unlock(&mutex);
+    STAT_SET(st->finished, monoNs());
     return NULL;
 }
 
 void *plusSignThread(void *args){
+    struct stageStats* st = args;
     while(1){
         // Lock the mutex before checking if the input buffer has data
         pthread_mutex_lock(&mutex);
         // Wait for buffer to have input
         while(strlen(seperateLines) == 0){
-            pthread_cond_wait(&sub, &mutex);
+            statWait(&sub, &mutex, NULL, st, &st->blockedEmpty);
             break;
         }
         // Replace all instances of ++
-        while(plusSignReplace(seperateLines));
+        int pending = 0;
+        size_t given = strlen(seperateLines);
+        size_t len = plusReplaceKernel(&pending, seperateLines, given, seperateLines, 1);
+        seperateLines[len] = 0;
+        STAT_ADD(st->bytesIn, given);
+        STAT_ADD(st->bytesOut, len);
+        STAT_ADD(st->items, given > 0);
         // Copy data to new buffer
         strcat(plusReplaced, seperateLines);
         memset(seperateLines, 0, sizeof(seperateLines));
@@ -158,37 +535,923 @@ void *plusSignThread(void *args){
     pthread_cond_signal(&out);
     // Unlock the mutex
     pthread_mutex_unlock(&mutex);
+    STAT_SET(st->finished, monoNs());
     return NULL;
 }
 
 void *outputThread(void *args){
+    struct stageStats* st = args;
+    struct outBatch batch = {fioAlloc(batchLines * 81), 0};
+    batch.stats = st;
+    size_t kept = 0; // Partial line left from the previous wakeup, already counted
     while(1){
         // Lock the mutex before checking if the input buffer has data
         pthread_mutex_lock(&mutex);
         // Wait for buffer to have input
         while(strlen(plusReplaced) == 0){
-            pthread_cond_wait(&out, &mutex);
+            // A held batch is written when its oldest line is due, if the lock comes back in time
+            if(batch.lines > 0 && flushPolicy == FLUSH_TIMER){
+                struct timespec deadline = batchDeadline(&batch);
+                if(statWait(&out, &mutex, &deadline, st, &st->blockedEmpty) == ETIMEDOUT){
+                    batchFlush(&batch);
+                    continue;
+                }
+                break;
+            }
+            statWait(&out, &mutex, NULL, st, &st->blockedEmpty);
             break;
         }
-        if(plusReplaced[strlen(plusReplaced) - 1] == '\255'){
-            plusReplaced[strlen(plusReplaced) - 1] = 0;
+        size_t len = strlen(plusReplaced);
+        if(len > 0 && plusReplaced[len - 1] == '\255'){
+            plusReplaced[--len] = 0;
             STOP = 1;
         }
-        // Output lines of 80 characters
-        while(strlen(plusReplaced) >= 80){
-            printFormat(plusReplaced);
+        if(len > kept){
+            STAT_ADD(st->bytesIn, len - kept);
+            STAT_ADD(st->items, 1);
+        }
+        // Output lines of 80 characters, reading forward from an offset
+        size_t offset = 0;
+        while(len - offset >= 80){
+            printFormat(&batch, plusReplaced + offset);
+            offset += 80;
+        }
+        // Keep the partial line by moving it down once
+        memmove(plusReplaced, plusReplaced + offset, len - offset + 1);
+        kept = len - offset;
+        // Every line has been passed on, so idle means now; batch waits for a full batch or STOP
+        if(STOP || flushPolicy == FLUSH_IDLE || (flushPolicy == FLUSH_TIMER && batchDue(&batch))){
+            batchFlush(&batch);
         }
-        fflush(stdout);
         // Unlock the mutex
         pthread_mutex_unlock(&mutex);
         if(STOP){
             break;
         }
     }
+    free(batch.buf);
+    STAT_SET(st->finished, monoNs());
     return NULL;
 }
 
-int main(void){
+/*
+Block input
+Input is read in large blocks with read(), or copied out of a mapping when standard input is a regular
+file. A block is cut after its last newline and the rest is carried into the next block, so a STOP
+line is never split between two blocks.
+*/
+struct blockReader{
+    int fd;
+    int eof;
+    int atLineStart;
+    int eager; // Return after the first read that ends a line instead of filling the block
+    char* carry; // Unfinished last line of the previous block
+    size_t carryLen;
+    char* map; // Whole input when it is a mapped regular file, else NULL
+    size_t mapLen;
+    size_t mapPos;
+};
+
+/*
+Function that sets up a block reader for fd, mapping it if it is a non-empty regular file.
+cap is the largest block that will be asked for.
+*/
+void blockReaderOpen(struct blockReader* br, int fd, size_t cap, int eager){
+    memset(br, 0, sizeof(*br));
+    br->fd = fd;
+    br->atLineStart = 1;
+    br->eager = eager;
+    if((br->map = fioMap(fd, &br->mapLen)) != NULL){
+        return;
+    }
+    br->carry = fioAlloc(cap);
+}
+
+/*
+Function that releases the mapping or carry buffer of a block reader
+*/
+void blockReaderClose(struct blockReader* br){
+    if(br->map){
+        munmap(br->map, br->mapLen);
+    }
+    free(br->carry);
+}
+
+/*
+Function that fills buf with the next block of input, ending after its last newline when it has one.
+Returns the number of bytes in the block.
+*/
+size_t readBlock(struct blockReader* br, char* buf, size_t cap, int* atLineStart, int* last){
+    *atLineStart = br->atLineStart;
+    if(br->map){
+        // Cut the block in the mapping itself, nothing has to be carried
+        const char* p = br->map + br->mapPos;
+        size_t len = br->mapLen - br->mapPos;
+        if(len > cap){
+            const char* nl = memrchr(p, '\n', cap);
+            len = nl ? (size_t)(nl - p + 1) : cap;
+            br->atLineStart = nl != NULL;
+        }
+        memcpy(buf, p, len);
+        br->mapPos += len;
+        *last = br->mapPos == br->mapLen;
+        return len;
+    }
+    size_t len = br->carryLen;
+    memcpy(buf, br->carry, len);
+    br->carryLen = 0;
+    while(len < cap && !br->eof){
+        ssize_t n = fioReadFd(br->fd, buf + len, cap - len);
+        if(n < 0){
+            perror("read");
+            exit(1);
+        }
+        if(n == 0){
+            br->eof = 1;
+            break;
+        }
+        len += n;
+        if(br->eager && memchr(buf + len - n, '\n', n)){
+            break;
+        }
+    }
+    *last = br->eof;
+    if(!br->eof){
+        char* nl = memrchr(buf, '\n', len);
+        if(nl){
+            br->carryLen = buf + len - (nl + 1);
+            memcpy(br->carry, nl + 1, br->carryLen);
+            len -= br->carryLen;
+        }
+        br->atLineStart = nl != NULL;
+    }
+    return len;
+}
+
+/*
+Function that walks the lines of a block, cutting it short at a STOP line and, if replace is set,
+turning each line separator into a space on the way. Returns the length of the block before any STOP.
+*/
+size_t scanLines(char* buf, size_t len, int atLineStart, int last, int replace, int* stop){
+    size_t s = 0;
+    *stop = 0;
+    while(s < len){
+        if(atLineStart && ((len - s >= 5 && !memcmp(buf + s, "STOP\n", 5)) || (last && len - s == 4 && !memcmp(buf + s, "STOP", 4)))){
+            *stop = 1;
+            return s;
+        }
+        char* nl = memchr(buf + s, '\n', len - s);
+        if(nl == NULL){
+            break;
+        }
+        if(replace){
+            *nl = ' ';
+        }
+        s = nl - buf + 1;
+        atLineStart = 1;
+    }
+    return len;
+}
+
+/*
+Streaming mode
+The input stage, every pipeline stage and the output stage each run in their own thread and hand whole
+chunks to the next one through a queue. Chunks come from a fixed pool, so a stage that gets ahead of
+its consumer blocks until a chunk is returned.
+*/
+struct chunk{
+    char* data; // Start of the valid bytes, inside buf
+    size_t len; // Number of valid bytes
+    int last; // Set on the final chunk of the stream
+    int sampled; // Chunk is timed for the latency histogram
+    unsigned long long born; // Monotonic nanoseconds when its input was read
+    struct chunk* next; // Link while the chunk sits in a queue
+    char buf[CHUNK_HEADROOM + CHUNK_SIZE];
+};
+
+struct chunkQueue{
+    struct chunk* head;
+    struct chunk* tail;
+    size_t count; // Chunks in the queue
+    size_t depth; // Most chunks the queue holds before pushes wait, 0 for no limit
+    size_t highWater; // Largest count seen
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+};
+
+/*
+Pipeline stage interface. transform rewrites one chunk in place. It may move c->data back into the
+headroom, and may grow c->len by up to growth times the bytes it was given plus FLUSH_SLACK.
+flush is called once with the final chunk after transform, to write out anything the stage held back.
+*/
+struct stage{
+    const char* name;
+    void* (*create)(void); // Optional, returns the per-run state passed to the other hooks
+    void (*transform)(void* state, struct chunk* c);
+    void (*flush)(void* state, struct chunk* c); // Optional
+    void (*destroy)(void* state); // Optional
+    int growth; // Most output bytes per input byte, the input stage sizes chunks to fit
+};
+
+/*
+A thread of the running pipeline, with the queues on either side of it. The input and output stages
+have no stage and only one queue.
+*/
+struct stageRun{
+    const struct stage* stage;
+    void* state;
+    struct chunkQueue* in;
+    struct chunkQueue* out;
+    struct stageStats* stats;
+};
+
+const struct stage* stageRegistry[MAX_STAGES];
+int registeredStages = 0;
+
+struct chunk* chunkPool;
+struct chunkQueue freeQueue = {NULL, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+size_t inputFill = CHUNK_SIZE - FLUSH_SLACK; // Most input bytes placed in one chunk
+int fuseNewlines = 0; // The input stage does the work of a leading newline stage
+
+/*
+Function that appends a chunk to a queue and wakes a waiting consumer, first waiting for room if the
+queue is full
+*/
+void queuePush(struct chunkQueue* q, struct chunk* c, struct stageStats* st){
+    c->next = NULL;
+    pthread_mutex_lock(&q->mutex);
+    while(q->depth && q->count >= q->depth){
+        statWait(&q->space, &q->mutex, NULL, st, st ? &st->blockedFull : NULL);
+    }
+    if(q->tail){
+        q->tail->next = c;
+    }
+    else{
+        q->head = c;
+    }
+    q->tail = c;
+    if(++q->count > q->highWater){
+        __atomic_store_n(&q->highWater, q->count, __ATOMIC_RELAXED);
+    }
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+Function that removes the oldest chunk from a queue, waiting while the queue is empty.
+Gives up and returns NULL if deadline is not NULL and passes first.
+*/
+struct chunk* queuePopUntil(struct chunkQueue* q, const struct timespec* deadline, struct stageStats* st){
+    pthread_mutex_lock(&q->mutex);
+    while(q->head == NULL){
+        if(statWait(&q->ready, &q->mutex, deadline, st, st ? &st->blockedEmpty : NULL) == ETIMEDOUT && q->head == NULL){
+            pthread_mutex_unlock(&q->mutex);
+            return NULL;
+        }
+    }
+    struct chunk* c = q->head;
+    q->head = c->next;
+    if(q->head == NULL){
+        q->tail = NULL;
+    }
+    --q->count;
+    if(q->depth){
+        pthread_cond_signal(&q->space);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return c;
+}
+
+/*
+Function that removes the oldest chunk from a queue, waiting while the queue is empty
+*/
+struct chunk* queuePop(struct chunkQueue* q, struct stageStats* st){
+    return queuePopUntil(q, NULL, st);
+}
+
+/*
+Function that reports whether a queue currently holds no chunks
+*/
+int queueIdle(struct chunkQueue* q){
+    pthread_mutex_lock(&q->mutex);
+    int idle = q->head == NULL;
+    pthread_mutex_unlock(&q->mutex);
+    return idle;
+}
+
+/*
+Function that takes an empty chunk from the pool, waiting until one is returned if all are in use.
+Time spent waiting counts as blocked on a full pipeline.
+*/
+struct chunk* chunkGet(struct stageStats* st){
+    pthread_mutex_lock(&freeQueue.mutex);
+    while(freeQueue.head == NULL){
+        statWait(&freeQueue.ready, &freeQueue.mutex, NULL, st, &st->blockedFull);
+    }
+    struct chunk* c = freeQueue.head;
+    freeQueue.head = c->next;
+    if(freeQueue.head == NULL){
+        freeQueue.tail = NULL;
+    }
+    pthread_mutex_unlock(&freeQueue.mutex);
+    c->data = c->buf + CHUNK_HEADROOM;
+    c->len = 0;
+    c->last = 0;
+    c->sampled = 0;
+    return c;
+}
+
+/*
+Function that returns a chunk to the pool
+*/
+void chunkPut(struct chunk* c){
+    queuePush(&freeQueue, c, NULL);
+}
+
+/*
+Function that adds a stage to the registry so pipelines can name it
+*/
+void registerStage(const struct stage* st){
+    if(registeredStages == MAX_STAGES){
+        fprintf(stderr, "Too many stages registered\n");
+        exit(1);
+    }
+    stageRegistry[registeredStages++] = st;
+}
+
+/*
+Function that finds a registered stage by name, NULL if there is none
+*/
+const struct stage* findStage(const char* name){
+    for(int i = 0; i < registeredStages; ++i){
+        if(!strcmp(stageRegistry[i]->name, name)){
+            return stageRegistry[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+Line separator stage. Replaces every newline with a space.
+*/
+void newlineTransform(void* state, struct chunk* c){
+    char* end = c->data + c->len;
+    for(char* p = c->data; (p = memchr(p, '\n', end - p)) != NULL; ++p){
+        *p = ' ';
+    }
+}
+
+/*
+Plus sign stage. Replaces "++" with "^". A '+' at the end of a chunk is held back until the first
+byte of the next chunk shows whether it starts a pair.
+*/
+void* plusCreate(void){
+    return calloc(1, sizeof(int));
+}
+
+void plusTransform(void* state, struct chunk* c){
+    int* pending = state;
+    // A held back '+' is written one byte early, into the chunk headroom
+    char* dst = *pending ? c->data - 1 : c->data;
+    c->len = plusReplaceKernel(pending, c->data, c->len, dst, c->last);
+    c->data = dst;
+}
+
+/*
+Control character stage. Drops bytes below space and DEL, keeping newlines and tabs.
+*/
+void ctrlTransform(void* state, struct chunk* c){
+    size_t w = 0;
+    for(size_t r = 0; r < c->len; ++r){
+        unsigned char ch = c->data[r];
+        if((ch >= ' ' && ch != 0x7f) || ch == '\n' || ch == '\t'){
+            c->data[w++] = ch;
+        }
+    }
+    c->len = w;
+}
+
+/*
+Tab stage. Expands each tab to spaces up to the next multiple of 8 output columns.
+*/
+struct tabState{
+    size_t column; // Column of the next byte within an 80 character line, as counted at this stage
+    char scratch[CHUNK_SIZE];
+};
+
+void* tabCreate(void){
+    return calloc(1, sizeof(struct tabState));
+}
+
+void tabTransform(void* state, struct chunk* c){
+    struct tabState* ts = state;
+    if(memchr(c->data, '\t', c->len) == NULL){
+        ts->column = (ts->column + c->len) % 80;
+        return;
+    }
+    size_t w = 0;
+    for(size_t r = 0; r < c->len; ++r){
+        if(c->data[r] == '\t'){
+            size_t spaces = 8 - ts->column % 8;
+            memset(ts->scratch + w, ' ', spaces);
+            w += spaces;
+            ts->column = (ts->column + spaces) % 80;
+        }
+        else{
+            ts->scratch[w++] = c->data[r];
+            ts->column = (ts->column + 1) % 80;
+        }
+    }
+    memcpy(c->data, ts->scratch, w);
+    c->len = w;
+}
+
+const struct stage newlineStage = {"newline", NULL, newlineTransform, NULL, NULL, 1};
+const struct stage plusStage = {"plus", plusCreate, plusTransform, NULL, free, 1};
+const struct stage ctrlStage = {"ctrl", NULL, ctrlTransform, NULL, NULL, 1};
+const struct stage tabStage = {"tabs", tabCreate, tabTransform, NULL, free, 8};
+
+/*
+Runs one pipeline stage over every chunk until the final one has passed through
+*/
+void *stageThread(void *args){
+    struct stageRun* run = args;
+    struct stageStats* st = run->stats;
+    while(1){
+        struct chunk* c = queuePop(run->in, st);
+        STAT_ADD(st->bytesIn, c->len);
+        run->stage->transform(run->state, c);
+        int last = c->last;
+        if(last && run->stage->flush){
+            run->stage->flush(run->state, c);
+        }
+        STAT_ADD(st->bytesOut, c->len);
+        STAT_ADD(st->items, 1);
+        queuePush(run->out, c, st);
+        if(last){
+            break;
+        }
+    }
+    STAT_SET(st->finished, monoNs());
+    return NULL;
+}
+
+/*
+Function that counts a filled input chunk, marks it for timing if it is a sampled one, and passes it on
+*/
+void inputPass(struct stageRun* run, struct chunk* c, unsigned long long* chunks){
+    c->sampled = sampleEvery && (*chunks)++ % sampleEvery == 0;
+    STAT_ADD(run->stats->bytesIn, c->len);
+    STAT_ADD(run->stats->bytesOut, c->len);
+    STAT_ADD(run->stats->items, 1);
+    queuePush(run->out, c, run->stats);
+}
+
+/*
+Streaming input stage. Reads blocks of many lines straight into chunks, finding a STOP line and, when
+the pipeline starts with the newline stage, replacing line separators in the same pass. Each read
+hands on what it got once a line is complete, so a terminal or slow pipe is not kept waiting.
+*/
+void *streamInputThread(void *args){
+    struct stageRun* run = args;
+    struct stageStats* st = run->stats;
+    unsigned long long chunks = 0;
+    struct blockReader br;
+    blockReaderOpen(&br, STDIN_FILENO, inputFill, 1);
+    while(1){
+        struct chunk* c = chunkGet(st);
+        int atLineStart;
+        int stop;
+        c->len = readBlock(&br, c->data, inputFill, &atLineStart, &c->last);
+        c->born = monoNs();
+        c->len = scanLines(c->data, c->len, atLineStart, c->last, fuseNewlines, &stop);
+        c->last |= stop;
+        int last = c->last;
+        inputPass(run, c, &chunks);
+        if(last){
+            break;
+        }
+    }
+    blockReaderClose(&br);
+    STAT_SET(st->finished, monoNs());
+    return NULL;
+}
+
+/*
+Function that waits for the next chunk for the output stage, flushing a partly filled batch as the
+flush policy asks
+*/
+struct chunk* outputPop(struct chunkQueue* in, struct outBatch* b){
+    struct stageStats* st = b->stats;
+    if(b->lines > 0 && flushPolicy == FLUSH_IDLE){
+        // Flush only when there is nothing left to process
+        struct timespec now = {0, 0};
+        struct chunk* c = queuePopUntil(in, &now, st);
+        if(c){
+            return c;
+        }
+        batchFlush(b);
+    }
+    while(b->lines > 0 && flushPolicy == FLUSH_TIMER){
+        struct timespec deadline = batchDeadline(b);
+        struct chunk* c = queuePopUntil(in, &deadline, st);
+        if(c){
+            return c;
+        }
+        batchFlush(b);
+    }
+    return queuePop(in, st);
+}
+
+/*
+Partial output line carried between calls to cutLines
+*/
+struct lineCutter{
+    char line[80];
+    size_t len;
+};
+
+/*
+Function that cuts processed bytes into lines of exactly 80 characters for the batch, keeping a
+partial line for the next call
+*/
+void cutLines(struct outBatch* b, struct lineCutter* lc, const char* p, size_t n){
+    const char* end = p + n;
+    // Complete the line left over from the previous call
+    if(lc->len > 0){
+        size_t take = end - p < 80 - lc->len ? end - p : 80 - lc->len;
+        memcpy(lc->line + lc->len, p, take);
+        lc->len += take;
+        p += take;
+        if(lc->len < 80){
+            return;
+        }
+        printFormat(b, lc->line);
+        lc->len = 0;
+    }
+    // Whole lines go straight into the batch
+    while(end - p >= 80){
+        printFormat(b, p);
+        p += 80;
+    }
+    memcpy(lc->line, p, end - p);
+    lc->len = end - p;
+}
+
+/*
+Streaming output stage. Cuts the stream into lines of exactly 80 characters, keeping a partial line
+across chunks, and writes them out in batches.
+*/
+void *streamOutputThread(void *args){
+    struct stageRun* run = args;
+    struct outBatch batch = {fioAlloc(batchLines * 81), 0};
+    batch.stats = run->stats;
+    struct lineCutter lc = {{0}, 0};
+    while(1){
+        struct chunk* c = outputPop(run->in, &batch);
+        STAT_ADD(run->stats->bytesIn, c->len);
+        STAT_ADD(run->stats->items, 1);
+        cutLines(&batch, &lc, c->data, c->len);
+        if(c->sampled){
+            batchSample(&batch, c->born);
+        }
+        int last = c->last;
+        chunkPut(c);
+        if(last){
+            break;
+        }
+    }
+    batchFlush(&batch);
+    free(batch.buf);
+    STAT_SET(run->stats->finished, monoNs());
+    return NULL;
+}
+
+/*
+Runs the streaming pipeline named by the comma separated stage list until STOP or end of input
+*/
+void streamMain(const char* pipeline){
+    // Look up every stage before starting any thread
+    const struct stage* stages[MAX_STAGES];
+    int count = 0;
+    int growth = 1;
+    char* names = strdup(pipeline);
+    for(char* name = strtok(names, ","); name; name = strtok(NULL, ",")){
+        const struct stage* st = findStage(name);
+        if(st == NULL){
+            fprintf(stderr, "Unknown stage `%s'\n", name);
+            exit(1);
+        }
+        // A leading newline stage is folded into the input stage's pass over each block
+        if(count == 0 && st == &newlineStage && !fuseNewlines){
+            fuseNewlines = 1;
+            continue;
+        }
+        if(count == MAX_STAGES){
+            fprintf(stderr, "Too many stages in pipeline\n");
+            exit(1);
+        }
+        // Checked before multiplying so a long chain of growing stages cannot overflow
+        if(growth > (CHUNK_SIZE - FLUSH_SLACK) / st->growth){
+            fprintf(stderr, "Pipeline grows data too much\n");
+            exit(1);
+        }
+        stages[count++] = st;
+        growth *= st->growth;
+    }
+    free(names);
+    // Leave room in every chunk for the stages that grow their data
+    inputFill = (CHUNK_SIZE - FLUSH_SLACK) / growth;
+    if(inputFill < 6){
+        fprintf(stderr, "Pipeline grows data too much\n");
+        exit(1);
+    }
+
+    size_t poolSize = POOL_CHUNKS + 2 * count;
+    chunkPool = malloc(poolSize * sizeof(struct chunk));
+    for(size_t i = 0; i < poolSize; ++i){
+        chunkPut(&chunkPool[i]);
+    }
+    struct chunkQueue queues[MAX_STAGES + 1];
+    for(int i = 0; i <= count; ++i){
+        queues[i].head = queues[i].tail = NULL;
+        queues[i].count = queues[i].highWater = 0;
+        queues[i].depth = QUEUE_DEPTH;
+        pthread_mutex_init(&queues[i].mutex, NULL);
+        pthread_cond_init(&queues[i].ready, NULL);
+        pthread_cond_init(&queues[i].space, NULL);
+    }
+
+    // runs[0] is the input stage and runs[count + 1] the output stage
+    struct stageRun runs[MAX_STAGES + 2] = {{0}};
+    pthread_t tid[MAX_STAGES + 2];
+    runs[0].out = &queues[0];
+    runs[0].stats = statsNew("input");
+    pthread_create(&tid[0], NULL, streamInputThread, &runs[0]);
+    for(int i = 1; i <= count; ++i){
+        runs[i].stage = stages[i - 1];
+        runs[i].state = stages[i - 1]->create ? stages[i - 1]->create() : NULL;
+        runs[i].in = &queues[i - 1];
+        runs[i].out = &queues[i];
+        runs[i].stats = statsNew(stages[i - 1]->name);
+        runs[i].stats->highWater = &queues[i - 1].highWater;
+        pthread_create(&tid[i], NULL, stageThread, &runs[i]);
+    }
+    runs[count + 1].in = &queues[count];
+    runs[count + 1].stats = statsNew("output");
+    runs[count + 1].stats->highWater = &queues[count].highWater;
+    pthread_create(&tid[count + 1], NULL, streamOutputThread, &runs[count + 1]);
+
+    for(int i = 0; i < count + 2; ++i){
+        pthread_join(tid[i], NULL);
+    }
+    for(int i = 1; i <= count; ++i){
+        if(runs[i].stage->destroy){
+            runs[i].stage->destroy(runs[i].state);
+        }
+    }
+    free(chunkPool);
+}
+
+/*
+Data-parallel mode
+A reader thread fills a ring of block slots, workers take filled blocks in any order, and the main
+thread puts finished blocks back together in sequence. Blocks end on a line boundary whenever the
+block holds a newline, so a STOP line is never split between two blocks.
+*/
+enum slotState{SLOT_FREE, SLOT_FILLED, SLOT_DONE};
+
+struct parSlot{
+    enum slotState state;
+    char* buf; // PAR_CHUNK bytes
+    size_t len; // Bytes read into buf
+    int atLineStart; // buf starts at the beginning of an input line
+    int last; // Final block of the input
+    int sampled; // Block is timed for the latency histogram
+    unsigned long long born; // Monotonic nanoseconds when the block was read
+    // Filled in by the worker
+    int stop; // Block ends at a STOP line
+    size_t leadPlus; // Length of the run of '+' the block starts with
+    size_t bodyLen; // Processed bytes after the leading run, at buf + leadPlus
+    int endPending; // Body ends with a single '+' held back for the next block
+};
+
+struct parSlot* parSlots;
+size_t parSlotCount;
+size_t nextFill = 0; // Sequence number of the next block to read
+size_t nextWork = 0; // Sequence number of the next block for a worker
+int parStop = 0; // Set once the output has seen the final block
+size_t parHighWater = 0; // Most blocks read and waiting for a worker
+pthread_mutex_t parMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t parCond = PTHREAD_COND_INITIALIZER;
+
+/*
+Data-parallel reader thread, fills free slots in sequence until end of input
+*/
+void *parReaderThread(void *args){
+    struct stageStats* st = args;
+    struct blockReader br;
+    // Eager like the streaming input stage, so a slow pipe is not held back until a whole block fills
+    blockReaderOpen(&br, STDIN_FILENO, PAR_CHUNK, 1);
+    while(1){
+        pthread_mutex_lock(&parMutex);
+        struct parSlot* slot = &parSlots[nextFill % parSlotCount];
+        while(slot->state != SLOT_FREE && !parStop){
+            statWait(&parCond, &parMutex, NULL, st, &st->blockedFull);
+        }
+        int stop = parStop;
+        pthread_mutex_unlock(&parMutex);
+        if(stop){
+            break;
+        }
+        slot->len = readBlock(&br, slot->buf, PAR_CHUNK, &slot->atLineStart, &slot->last);
+        slot->born = monoNs();
+        slot->sampled = sampleEvery && nextFill % sampleEvery == 0;
+        STAT_ADD(st->bytesIn, slot->len);
+        STAT_ADD(st->bytesOut, slot->len);
+        STAT_ADD(st->items, 1);
+        pthread_mutex_lock(&parMutex);
+        slot->state = SLOT_FILLED;
+        ++nextFill;
+        if(nextFill - nextWork > parHighWater){
+            __atomic_store_n(&parHighWater, nextFill - nextWork, __ATOMIC_RELAXED);
+        }
+        pthread_cond_broadcast(&parCond);
+        pthread_mutex_unlock(&parMutex);
+        if(slot->last){
+            break;
+        }
+    }
+    blockReaderClose(&br);
+    STAT_SET(st->finished, monoNs());
+    return NULL;
+}
+
+/*
+Function that replaces line separators and plus signs in one block, stopping at a STOP line.
+A run of '+' at the start of the block is left for the main thread, which knows whether the block
+before ended with a held back '+'.
+*/
+void parProcess(struct parSlot* slot){
+    char* buf = slot->buf;
+    size_t len = slot->len;
+    // Line separators, checking each whole line for STOP on the way
+    len = scanLines(buf, len, slot->atLineStart, slot->last, 1, &slot->stop);
+    // Plus signs after the leading run
+    size_t lead = 0;
+    while(lead < len && buf[lead] == '+'){
+        ++lead;
+    }
+    int pending = 0;
+    slot->leadPlus = lead;
+    slot->bodyLen = plusReplaceKernel(&pending, buf + lead, len - lead, buf + lead, slot->last || slot->stop);
+    slot->endPending = pending;
+}
+
+/*
+Data-parallel worker thread, processes filled slots until the main thread stops the run
+*/
+void *parWorkerThread(void *args){
+    struct stageStats* st = args;
+    while(1){
+        pthread_mutex_lock(&parMutex);
+        while(nextWork == nextFill && !parStop){
+            statWait(&parCond, &parMutex, NULL, st, &st->blockedEmpty);
+        }
+        if(parStop){
+            pthread_mutex_unlock(&parMutex);
+            STAT_SET(st->finished, monoNs());
+            return NULL;
+        }
+        struct parSlot* slot = &parSlots[nextWork++ % parSlotCount];
+        pthread_mutex_unlock(&parMutex);
+
+        STAT_ADD(st->bytesIn, slot->len);
+        parProcess(slot);
+        STAT_ADD(st->bytesOut, slot->bodyLen);
+        STAT_ADD(st->items, 1);
+
+        pthread_mutex_lock(&parMutex);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&parCond);
+        pthread_mutex_unlock(&parMutex);
+    }
+}
+
+/*
+Function that writes count '^' characters, the pairs from a run of plus signs
+*/
+void cutCarets(struct outBatch* b, struct lineCutter* lc, size_t count){
+    static const char carets[] = "^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^";
+    while(count > 0){
+        size_t n = count < sizeof(carets) - 1 ? count : sizeof(carets) - 1;
+        cutLines(b, lc, carets, n);
+        count -= n;
+    }
+}
+
+/*
+Runs the data-parallel mode with the given number of workers until STOP or end of input
+*/
+void parMain(int workers){
+    parSlotCount = 2 * workers + 2;
+    parSlots = calloc(parSlotCount, sizeof(struct parSlot));
+    for(size_t i = 0; i < parSlotCount; ++i){
+        parSlots[i].buf = malloc(PAR_CHUNK);
+    }
+
+    // The reader may be blocked on a terminal after STOP, so it is never joined
+    pthread_t reader;
+    pthread_create(&reader, NULL, parReaderThread, statsNew("reader"));
+    pthread_detach(reader);
+    pthread_t tid[MAX_WORKERS];
+    for(int i = 0; i < workers; ++i){
+        char name[32];
+        sprintf(name, "worker%d", i);
+        struct stageStats* st = statsNew(name);
+        st->highWater = &parHighWater;
+        pthread_create(&tid[i], NULL, parWorkerThread, st);
+    }
+
+    struct stageStats* st = statsNew("output");
+    struct outBatch batch = {fioAlloc(batchLines * 81), 0};
+    batch.stats = st;
+    struct lineCutter lc = {{0}, 0};
+    int carry = 0; // The previous block ended with a single '+' held back
+    for(size_t seq = 0;; ++seq){
+        struct parSlot* slot = &parSlots[seq % parSlotCount];
+        pthread_mutex_lock(&parMutex);
+        if(slot->state != SLOT_DONE && flushPolicy == FLUSH_IDLE && batch.lines > 0){
+            // Nothing ready to write, send out what is held instead of waiting on it
+            pthread_mutex_unlock(&parMutex);
+            batchFlush(&batch);
+            pthread_mutex_lock(&parMutex);
+        }
+        while(slot->state != SLOT_DONE){
+            if(flushPolicy == FLUSH_TIMER && batch.lines > 0){
+                // Wait only until the oldest held line is due, then write the batch out
+                struct timespec deadline = batchDeadline(&batch);
+                if(statWait(&parCond, &parMutex, &deadline, st, &st->blockedEmpty) == ETIMEDOUT && slot->state != SLOT_DONE){
+                    pthread_mutex_unlock(&parMutex);
+                    batchFlush(&batch);
+                    pthread_mutex_lock(&parMutex);
+                }
+                continue;
+            }
+            statWait(&parCond, &parMutex, NULL, st, &st->blockedEmpty);
+        }
+        pthread_mutex_unlock(&parMutex);
+        STAT_ADD(st->bytesIn, slot->leadPlus + slot->bodyLen);
+        STAT_ADD(st->items, 1);
+
+        // Pair the leading run with any '+' held back from the previous block
+        int final = slot->last || slot->stop;
+        size_t run = slot->leadPlus + carry;
+        cutCarets(&batch, &lc, run / 2);
+        if(slot->bodyLen == 0){
+            // Block is all plus signs, the run may go on into the next block
+            carry = run % 2;
+        }
+        else{
+            if(run % 2){
+                cutLines(&batch, &lc, "+", 1);
+            }
+            cutLines(&batch, &lc, slot->buf + slot->leadPlus, slot->bodyLen);
+            carry = slot->endPending;
+        }
+        if(slot->sampled){
+            batchSample(&batch, slot->born);
+        }
+        if(final){
+            if(carry){
+                cutLines(&batch, &lc, "+", 1);
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&parMutex);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&parCond);
+        pthread_mutex_unlock(&parMutex);
+    }
+    batchFlush(&batch);
+    free(batch.buf);
+    STAT_SET(st->finished, monoNs());
+
+    pthread_mutex_lock(&parMutex);
+    parStop = 1;
+    pthread_cond_broadcast(&parCond);
+    pthread_mutex_unlock(&parMutex);
+    for(int i = 0; i < workers; ++i){
+        pthread_join(tid[i], NULL);
+    }
+}
+
+/*
+Runs the classic four thread pipeline
+*/
+void classicMain(void){
     /*
     Outline for producer consumer approach adapted from Conditional Variables learning module
     */
@@ -197,16 +1460,16 @@ int main(void){
 
     // Create a thread and tell it to run the function
     pthread_t tid;
-    pthread_create(&tid, NULL, inputThread, NULL);
+    pthread_create(&tid, NULL, inputThread, statsNew("input"));
 
     pthread_t tid2;
-    pthread_create(&tid2, NULL, lineSeparatorThread, NULL);
+    pthread_create(&tid2, NULL, lineSeparatorThread, statsNew("separator"));
 
     pthread_t tid3;
-    pthread_create(&tid3, NULL, plusSignThread, NULL);
+    pthread_create(&tid3, NULL, plusSignThread, statsNew("plus"));
 
     pthread_t tid4;
-    pthread_create(&tid4, NULL, outputThread, NULL);
+    pthread_create(&tid4, NULL, outputThread, statsNew("output"));
 
     // Wait for the threads to finish
     pthread_join(tid, NULL); // Call after to run concurrently
@@ -216,6 +1479,440 @@ int main(void){
 
     // Destroy Mutex
     pthread_mutex_destroy(&mutex);
+}
+
+/*
+Benchmark and correctness harness
+-X generates an input file, writes the output it should give with a plain reference implementation,
+then runs every mode over it in a child process, checking and timing each run. The child copies its
+counters into shared memory so the harness can report stage utilization and latency percentiles.
+*/
+struct benchOptions{
+    unsigned long long size; // Bytes of input to generate
+    size_t maxLine; // Longest generated line
+    double density; // Chance that a character starts a run of plus signs
+    int maxRun; // Longest run of plus signs, 3 gives "+++"
+};
+
+struct benchShared{
+    int stages;
+    struct stageStats stats[MAX_STATS];
+    unsigned long long hist[LAT_BUCKETS];
+    unsigned long long samples;
+};
+
+/*
+Function that returns the next number from a xorshift generator, so runs can be repeated exactly
+*/
+unsigned long long benchRand(unsigned long long* state){
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*
+Function that writes size bytes of generated lines, then a STOP line and a line that must be ignored
+*/
+void benchGenerate(FILE* f, const struct benchOptions* opt){
+    static const char letters[] = "abcdefgh ";
+    unsigned long long state = 0x9e3779b97f4a7c15ULL;
+    unsigned long long written = 0;
+    unsigned long long threshold = opt->density * 4294967296.0;
+    char* line = malloc(opt->maxLine + 1);
+    while(written < opt->size){
+        size_t len = benchRand(&state) % (opt->maxLine + 1);
+        for(size_t i = 0; i < len;){
+            unsigned long long r = benchRand(&state);
+            if((r & 0xffffffff) < threshold){
+                size_t run = 1 + (r >> 32) % opt->maxRun;
+                for(; run > 0 && i < len; --run){
+                    line[i++] = '+';
+                }
+            }
+            else{
+                line[i++] = letters[(r >> 32) % (sizeof(letters) - 1)];
+            }
+        }
+        line[len] = '\n';
+        fwrite(line, 1, len + 1, f);
+        written += len + 1;
+    }
+    fputs("STOP\nthis line comes after STOP\n", f);
+    free(line);
+}
+
+/*
+Function that adds one processed character to the reference output
+*/
+void benchEmit(FILE* out, char* line, size_t* col, char ch){
+    line[(*col)++] = ch;
+    if(*col == 80){
+        fwrite(line, 1, 80, out);
+        fputc('\n', out);
+        *col = 0;
+    }
+}
+
+/*
+Reference implementation, one character at a time with no concurrency
+*/
+void benchReference(FILE* in, FILE* out){
+    char* text = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    char line[80];
+    size_t col = 0;
+    int plus = 0;
+    while((n = getline(&text, &cap, in)) > 0){
+        int newline = text[n - 1] == '\n';
+        if(n - newline == 4 && !memcmp(text, "STOP", 4)){
+            break;
+        }
+        for(ssize_t i = 0; i < n; ++i){
+            char ch = text[i] == '\n' ? ' ' : text[i];
+            if(ch == '+' && plus){
+                benchEmit(out, line, &col, '^');
+                plus = 0;
+            }
+            else if(ch == '+'){
+                plus = 1;
+            }
+            else{
+                if(plus){
+                    benchEmit(out, line, &col, '+');
+                    plus = 0;
+                }
+                benchEmit(out, line, &col, ch);
+            }
+        }
+    }
+    if(plus){
+        benchEmit(out, line, &col, '+');
+    }
+    free(text);
+}
+
+/*
+Function that reports whether two files have the same contents
+*/
+int benchSame(const char* a, const char* b){
+    FILE* fa = fopen(a, "r");
+    FILE* fb = fopen(b, "r");
+    int same = fa && fb;
+    static char bufA[65536];
+    static char bufB[65536];
+    while(same){
+        size_t na = fread(bufA, 1, sizeof(bufA), fa);
+        size_t nb = fread(bufB, 1, sizeof(bufB), fb);
+        same = na == nb && !memcmp(bufA, bufB, na);
+        if(na == 0){
+            break;
+        }
+    }
+    if(fa){
+        fclose(fa);
+    }
+    if(fb){
+        fclose(fb);
+    }
+    return same;
+}
+
+/*
+Function that estimates a latency percentile from a copied histogram, as a bucket upper bound
+*/
+unsigned long long benchPercentile(const struct benchShared* sh, double p){
+    unsigned long long seen = 0;
+    for(int i = 0; i < LAT_BUCKETS; ++i){
+        seen += sh->hist[i];
+        if(sh->samples > 0 && seen >= p * sh->samples){
+            return latencyUpper(i);
+        }
+    }
+    return 0;
+}
+
+/*
+Function that runs one mode in a child process with the input file on standard input and the output
+file on standard output. Prints one line of results and returns 1 if the output was right.
+*/
+int benchRun(const char* label, const char* mode, const char* pipeline, int workers, const char* inPath, const char* outPath, const char* expectPath, unsigned long long inBytes, struct benchShared* sh){
+    memset(sh, 0, sizeof(*sh));
+    unsigned long long start = monoNs();
+    pid_t pid = fork();
+    if(pid == -1){
+        perror("fork");
+        exit(1);
+    }
+    if(pid == 0){
+        int in = open(inPath, O_RDONLY);
+        int out = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(in == -1 || out == -1 || dup2(in, STDIN_FILENO) == -1 || dup2(out, STDOUT_FILENO) == -1){
+            perror("harness child");
+            _exit(1);
+        }
+        runMode = mode;
+        if(!strcmp(mode, "streaming")){
+            streamMain(pipeline);
+        }
+        else if(!strcmp(mode, "parallel")){
+            parMain(workers);
+        }
+        else{
+            classicMain();
+        }
+        sh->stages = statsCount;
+        for(int i = 0; i < statsCount; ++i){
+            sh->stats[i] = *statsTable[i];
+            sh->stats[i].highWater = NULL;
+        }
+        memcpy(sh->hist, latencyHist, sizeof(latencyHist));
+        sh->samples = latencySamples;
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    double seconds = (monoNs() - start) / 1e9;
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && benchSame(expectPath, outPath);
+
+    char p50[32] = "-";
+    char p99[32] = "-";
+    if(sh->samples > 0){
+        snprintf(p50, sizeof(p50), "%llu", benchPercentile(sh, 0.5));
+        snprintf(p99, sizeof(p99), "%llu", benchPercentile(sh, 0.99));
+    }
+    printf("%-12s %10.1f %10s %10s %6s ", label, inBytes / seconds / 1e6, p50, p99, ok ? "ok" : "FAIL");
+    for(int i = 0; i < sh->stages; ++i){
+        struct stageStats* st = &sh->stats[i];
+        double run = st->finished > st->started ? (double)(st->finished - st->started) : 1;
+        printf(" %s=%.2f", st->name, 1 - (st->blockedFull + st->blockedEmpty) / run);
+    }
+    if(sh->stages == 0){
+        printf(" (not instrumented)");
+    }
+    printf("\n");
+    fflush(stdout);
+    return ok;
+}
+
+/*
+Function that makes a temporary file name from a template and returns it open for writing
+*/
+FILE* benchTemp(char* path){
+    int fd = mkstemp(path);
+    if(fd == -1){
+        perror(path);
+        exit(1);
+    }
+    return fdopen(fd, "w+");
+}
+
+/*
+Runs the harness, returns the process exit status
+*/
+int benchMain(const struct benchOptions* opt, const char* pipeline, int workers){
+    const char* dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char inPath[4096];
+    char expectPath[4096];
+    char outPath[4096];
+    snprintf(inPath, sizeof(inPath), "%s/lp_input_XXXXXX", dir);
+    snprintf(expectPath, sizeof(expectPath), "%s/lp_expect_XXXXXX", dir);
+    snprintf(outPath, sizeof(outPath), "%s/lp_output_XXXXXX", dir);
+
+    FILE* in = benchTemp(inPath);
+    benchGenerate(in, opt);
+    fflush(in);
+    unsigned long long inBytes = ftell(in);
+    rewind(in);
+    FILE* expect = benchTemp(expectPath);
+    benchReference(in, expect);
+    unsigned long long expectLines = ftell(expect) / 81;
+    fclose(in);
+    fclose(expect);
+    fclose(benchTemp(outPath));
+
+    printf("input %llu bytes, lines up to %zu, plus density %.2f, runs up to %d, %llu output lines\n", inBytes, opt->maxLine, opt->density, opt->maxRun, expectLines);
+    printf("%-12s %10s %10s %10s %6s  %s\n", "mode", "MB/s", "p50 us", "p99 us", "check", "stage utilization");
 
+    struct benchShared* sh = mmap(NULL, sizeof(struct benchShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(sh == MAP_FAILED){
+        perror("mmap");
+        exit(1);
+    }
+    if(sampleEvery == 0){
+        sampleEvery = 1;
+    }
+    int ok = 1;
+    // The classic pipeline only handles lines under 1000 bytes and stops after 49 output lines
+    if(opt->maxLine < 998 && expectLines < 49){
+        ok &= benchRun("classic", "classic", NULL, 0, inPath, outPath, expectPath, inBytes, sh);
+    }
+    else{
+        printf("%-12s skipped, input is beyond the classic pipeline's limits\n", "classic");
+    }
+    ok &= benchRun("streaming", "streaming", pipeline, 0, inPath, outPath, expectPath, inBytes, sh);
+    ok &= benchRun("parallel-1", "parallel", NULL, 1, inPath, outPath, expectPath, inBytes, sh);
+    if(workers > 1){
+        char label[32];
+        snprintf(label, sizeof(label), "parallel-%d", workers);
+        ok &= benchRun(label, "parallel", NULL, workers, inPath, outPath, expectPath, inBytes, sh);
+    }
+
+    munmap(sh, sizeof(struct benchShared));
+    unlink(inPath);
+    unlink(expectPath);
+    unlink(outPath);
+    return ok ? 0 : 1;
+}
+
+/*
+Function that reads a byte count with an optional K, M or G suffix
+*/
+unsigned long long parseSize(const char* s){
+    char* end;
+    unsigned long long n = strtoull(s, &end, 10);
+    switch(*end){
+        case 'G': case 'g':
+            n <<= 10;
+            // fall through
+        case 'M': case 'm':
+            n <<= 10;
+            // fall through
+        case 'K': case 'k':
+            n <<= 10;
+    }
+    return n;
+}
+
+/*
+Function that prints the usage message and exits
+*/
+void usage(const char* prog){
+    fprintf(stderr, "Usage: %s [-s | -P STAGE,... | -p WORKERS] [-b LINES] [-f idle|batch|timer] [-t MS] [-S FILE] [-L N]\n"
+                    "       %s -X [-n SIZE] [-l MAXLINE] [-d DENSITY] [-r MAXRUN] [-p WORKERS] [-P STAGE,...]\n", prog, prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]){
+    int streaming = 0;
+    const char* pipeline = "newline,plus";
+    int workers = 0;
+    int harness = 0;
+    struct benchOptions bench = {64 << 20, 200, 0.2, 3};
+    int opt;
+
+    registerStage(&newlineStage);
+    registerStage(&plusStage);
+    registerStage(&ctrlStage);
+    registerStage(&tabStage);
+
+    while((opt = getopt(argc, argv, "sP:p:b:f:t:S:L:Xn:l:d:r:")) != -1){
+        switch(opt){
+            case 's':
+                streaming = 1;
+                break;
+            case 'P':
+                streaming = 1;
+                pipeline = optarg;
+                break;
+            case 'p':
+                workers = atoi(optarg);
+                if(workers < 1 || workers > MAX_WORKERS){
+                    usage(argv[0]);
+                }
+                break;
+            case 'b':
+                batchLines = strtoul(optarg, NULL, 10);
+                if(batchLines == 0){
+                    usage(argv[0]);
+                }
+                break;
+            case 'f':
+                if(!strcmp(optarg, "idle")){
+                    flushPolicy = FLUSH_IDLE;
+                }
+                else if(!strcmp(optarg, "batch")){
+                    flushPolicy = FLUSH_BATCH;
+                }
+                else if(!strcmp(optarg, "timer")){
+                    flushPolicy = FLUSH_TIMER;
+                }
+                else{
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                flushMillis = strtol(optarg, NULL, 10);
+                flushPolicy = FLUSH_TIMER;
+                break;
+            case 'S':
+                statsOut = strcmp(optarg, "-") ? fopen(optarg, "w") : stderr;
+                if(statsOut == NULL){
+                    perror(optarg);
+                    exit(1);
+                }
+                break;
+            case 'L':
+                sampleEvery = atoi(optarg);
+                if(sampleEvery < 1){
+                    usage(argv[0]);
+                }
+                break;
+            case 'X':
+                harness = 1;
+                break;
+            case 'n':
+                bench.size = parseSize(optarg);
+                break;
+            case 'l':
+                bench.maxLine = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                bench.density = strtod(optarg, NULL);
+                break;
+            case 'r':
+                bench.maxRun = atoi(optarg);
+                if(bench.maxRun < 1){
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    // The classic threads pass text along in shared strings, with no chunks to time
+    if(sampleEvery && !harness && !streaming && workers == 0){
+        fprintf(stderr, "-L needs -s, -P or -p\n");
+        exit(1);
+    }
+
+    // SIGUSR1 is taken by the stats thread only, so block it before any other thread starts
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+    pthread_t statsTid;
+    pthread_create(&statsTid, NULL, statsSignalThread, NULL);
+    pthread_detach(statsTid);
+
+    if(harness){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        return benchMain(&bench, pipeline, workers > 0 ? workers : (cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus));
+    }
+    if(streaming){
+        runMode = "streaming";
+        streamMain(pipeline);
+    }
+    else if(workers > 0){
+        runMode = "parallel";
+        parMain(workers);
+    }
+    else{
+        classicMain();
+    }
+    if(statsOut){
+        statsDump(statsOut, "exit");
+    }
     return 0;
 }
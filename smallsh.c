@@ -8,16 +8,21 @@
     Provide a prompt for running commands
     Handle blank lines and comments, which are lines beginning with the # character
     Provide expansion for the variable $$
-    Execute 3 commands exit, cd, and status via code built into the shell
-    Execute other commands by creating new processes using a function from the exec family of functions
+    Execute builtins from a sorted dispatch table: exit, cd, status, hash, jobs, wait, fg, bg, echo, pwd,
+    printf, test/[, true, and false run in the shell, or in a forked child inside pipelines and background jobs
+    Execute other commands by creating new processes using posix_spawn
     Support input and output redirection
-    Support running commands in foreground and background processes
+    Support pipelines of commands joined by |, run concurrently in one process group
+    Support running commands in foreground and background processes, tracked in a job table
+    Run commands from a script file or -c without prompts, with -j limiting running background jobs
+    Report resource use with the time prefix, and log it per command to the file named by SMALLSH_STATS
+    Benchmark command launch against other shells with -B
     Implement custom handlers for 2 signals, SIGINT and SIGTSTP
 */
 
-// Define POSIX for signal handling if not pre-defined
+// Define GNU for signal handling and pipe2() if not pre-defined
 // Must be done before include
-#define _POSIX_SOURCE
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -32,9 +37,22 @@
 #include <signal.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #define CLI_LENGTH 2048
 #define MAX_ARGS 512
+#define MAX_PIPE 16
+#define DONE_JOBS_KEPT 64 // Finished background jobs kept for wait when not interactive
+// Lexer output for one line: $$ (2 bytes) expands to at most 7 digits, and every word adds a NUL,
+// so four bytes per input byte always fit
+#define ARENA_SIZE (CLI_LENGTH * 4)
+#define HASH_SIZE 256 // Buckets in the command path cache, a power of two
+#define BENCH_WORKLOADS 5
+#define MAX_BENCH_SHELLS 8
 // Define home directory as starting directoy
 #define HOME_DIR getenv("PWD")
 
@@ -46,16 +64,121 @@ int foregroundOnly = 0;
 //Status for most recent non-background process exited
 int lastStatus = 0;
 
+/*
+Command path cache entry, chained per bucket
+*/
+struct hashEntry{
+    char* name;
+    char* path;
+    unsigned hits;
+    struct hashEntry* next;
+};
+struct hashEntry* pathCache[HASH_SIZE];
+// PATH the cache was filled from, the cache is dropped when it changes
+char* cachedPath = NULL;
+
+// Descriptor of the SMALLSH_STATS log, -1 when not logging
+int statsFd = -1;
+
+/*
+Resources used by a command, summed over its stages
+*/
+struct usage{
+    long long start; // Monotonic clock at launch, in ns
+    double user; // CPU seconds
+    double sys;
+    long maxrss; // kB, largest of any stage
+    long ctxsw; // Voluntary and involuntary context switches
+};
+
+// Job states
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+/*
+Job table entry, one per pipeline whose status has not been reported or collected by wait yet, kept in
+id order
+*/
+struct job{
+    int id;
+    pid_t pgid;
+    pid_t pids[MAX_PIPE]; // -1 once reaped or if the stage never started
+    pid_t lastPid; // Pid reported for the job, its last stage
+    int alive; // Stages not reaped yet
+    int status; // Wait status of the last stage
+    int state;
+    int background;
+    int notified; // Stop already reported
+    int timed; // Started with the time prefix
+    struct usage usage;
+    char cmd[256];
+    struct job* next;
+};
+struct job* jobList = NULL;
+// SIGCHLD is blocked in the shell and read from this descriptor instead
+int sigchldFd = -1;
+
+// Prompts and job reports are on unless running a script file or -c commands
+int interactive = 1;
+// Running background jobs allowed at once with -j, 0 for no limit
+int jobSlots = 0;
+// Commands from -c, read in place of inFd
+const char* scriptText = NULL;
+// Descriptor commands are read from, stdin or a script file
+int inFd = STDIN_FILENO;
+
+// Token kinds returned by nextToken()
+#define TOK_END 0
+#define TOK_WORD 1
+#define TOK_PIPE 2
+#define TOK_IN 3
+#define TOK_OUT 4
+#define TOK_AMP 5
+#define TOK_ERROR 6 // Unterminated quote
+
+// Words of the current line, reset for every line so parsing never touches the heap
+char arena[ARENA_SIZE];
+size_t arenaUsed = 0;
+// Shell pid as text, what $$ expands to
+char pidStr[12];
+
+// Line reader buffer for inFd
+char inBuf[CLI_LENGTH];
+size_t inStart = 0;
+size_t inEnd = 0;
+int inEof = 0;
+
 /*
 Input struct for command line entry storage
+Every stage of a pipeline keeps its arguments in args, each stage ending with a NULL entry
 */
 struct Input{ 
+    char* line; // Command as typed, for the job table
+    int timed; // Report resource use, the line started with time
     char* args[MAX_ARGS];
-    char inputFile[256];
-    char outputFile[256];
+    int stages[MAX_PIPE]; // Index in args where each stage starts
+    int nstages;
+    int nargs; // Entries used in args, including the NULL after each stage
+    char* inputFile[MAX_PIPE]; // Per stage, NULL for no redirection
+    char* outputFile[MAX_PIPE];
     int background;
 };
 
+/*
+Builtin command, run by the shell itself. run returns the exit value.
+Kept sorted by name in builtins[] for findBuiltin()
+*/
+struct builtin{
+    const char* name;
+    int (*run)(char** args);
+};
+const struct builtin* findBuiltin(const char* name);
+// Set by the exit builtin
+int exitRequested = 0;
+// Value given to exit N, -1 when exit had no argument
+int exitValueGiven = -1;
+
 /* 
 Signal handler for SIGSTP 
 Taken from canvas template
@@ -67,184 +190,1440 @@ void handle_SIGTSTP(){
         fflush(stdout);
         foregroundOnly = 1;
     }
-    else{
-        char* message = "Exiting foreground-only mode\n";
-        write(STDOUT_FILENO, message, 30);
-        fflush(stdout);
-        foregroundOnly = 0;
+    else{
+        char* message = "Exiting foreground-only mode\n";
+        write(STDOUT_FILENO, message, 30);
+        fflush(stdout);
+        foregroundOnly = 0;
+    }
+}
+
+/*
+Function that reads the next token of a command line at *pos and advances past it.
+Words are unquoted, unescaped, and $$-expanded in the same pass, written into the line arena, and
+returned through word. Single quotes keep everything literal, double quotes still expand $$ and allow
+\" \\ and \$, and a backslash outside quotes keeps the next character literal. | < > and & are
+operators wherever they are unquoted.
+Returns one of the TOK_ kinds.
+*/
+int nextToken(const char** pos, char** word){
+    const char* p = *pos;
+    while(*p == ' ' || *p == '\t'){
+        ++p;
+    }
+    *pos = p + 1;
+    switch(*p){
+        case 0:
+            *pos = p;
+            return TOK_END;
+        case '|':
+            return TOK_PIPE;
+        case '<':
+            return TOK_IN;
+        case '>':
+            return TOK_OUT;
+        case '&':
+            return TOK_AMP;
+    }
+
+    char* out = arena + arenaUsed;
+    char quote = 0;
+    while(*p){
+        char c = *p;
+        if(quote == '\''){
+            if(c == '\''){
+                quote = 0;
+            }
+            else{
+                *out++ = c;
+            }
+            ++p;
+            continue;
+        }
+        // Unquoted blanks and operators end the word
+        if(!quote && strchr(" \t|<>&", c) != NULL){
+            break;
+        }
+        // A quote opens a string, and only the same kind closes it
+        if((c == '\'' || c == '"') && (!quote || c == quote)){
+            quote = quote ? 0 : c;
+            ++p;
+        }
+        else if(c == '\\' && p[1] != 0){
+            // Inside double quotes only a few characters can be escaped
+            if(quote && strchr("\"\\$", p[1]) == NULL){
+                *out++ = c;
+            }
+            *out++ = p[1];
+            p += 2;
+        }
+        //Variable expansion for $$
+        else if(c == '$' && p[1] == '$'){
+            for(const char* d = pidStr; *d; ++d){
+                *out++ = *d;
+            }
+            p += 2;
+        }
+        else{
+            *out++ = c;
+            ++p;
+        }
+    }
+    *pos = p;
+    if(quote){
+        return TOK_ERROR;
+    }
+    *out++ = 0;
+    *word = arena + arenaUsed;
+    arenaUsed = out - arena;
+    return TOK_WORD;
+}
+
+/*
+Function that hashes a command name into a pathCache bucket (FNV-1a)
+*/
+unsigned hashName(const char* name){
+    unsigned h = 2166136261u;
+    for(; *name; ++name){
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h & (HASH_SIZE - 1);
+}
+
+/*
+Function that empties the command path cache
+*/
+void hashClear(){
+    for(int i = 0; i < HASH_SIZE; ++i){
+        while(pathCache[i] != NULL){
+            struct hashEntry* entry = pathCache[i];
+            pathCache[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+/*
+Function that removes one command from the cache, used when its cached path no longer executes
+*/
+void hashForget(const char* name){
+    struct hashEntry** link = &pathCache[hashName(name)];
+    while(*link != NULL){
+        if(!strcmp((*link)->name, name)){
+            struct hashEntry* entry = *link;
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/*
+Function that resolves a command name to the file to execute. Names containing a / are used as given.
+Others are looked up in the cache, then searched for in each PATH directory, and absolute results are
+cached so later runs skip the search. Relative results (from . or empty PATH entries) depend on the
+working directory and are returned from a static buffer without caching.
+Returns NULL if the command is not found.
+*/
+const char* hashLookup(const char* name){
+    static char found[4096];
+    if(strchr(name, '/') != NULL){
+        return name;
+    }
+
+    // Drop the cache if PATH changed since it was filled
+    const char* path = getenv("PATH");
+    if(path == NULL){
+        path = "/bin:/usr/bin";
+    }
+    if(cachedPath == NULL || strcmp(cachedPath, path)){
+        hashClear();
+        free(cachedPath);
+        cachedPath = strdup(path);
+    }
+
+    unsigned bucket = hashName(name);
+    for(struct hashEntry* entry = pathCache[bucket]; entry != NULL; entry = entry->next){
+        if(!strcmp(entry->name, name)){
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    // Search PATH, an empty entry means the current directory
+    const char* dir = path;
+    while(1){
+        const char* end = strchr(dir, ':');
+        size_t dirLen = end ? (size_t)(end - dir) : strlen(dir);
+        struct stat sb;
+        if(dirLen == 0){
+            snprintf(found, sizeof(found), "%s", name);
+        }
+        else{
+            snprintf(found, sizeof(found), "%.*s/%s", (int)dirLen, dir, name);
+        }
+        if(!stat(found, &sb) && S_ISREG(sb.st_mode) && !access(found, X_OK)){
+            if(found[0] != '/'){
+                return found;
+            }
+            struct hashEntry* entry = malloc(sizeof(struct hashEntry));
+            entry->name = strdup(name);
+            entry->path = strdup(found);
+            entry->hits = 1;
+            entry->next = pathCache[bucket];
+            pathCache[bucket] = entry;
+            return entry->path;
+        }
+        if(end == NULL){
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+/*
+Function for the hash builtin: no arguments lists the cache, -r clears it, names are looked up and added
+*/
+int hashBuiltin(char** args){
+    if(args[1] == NULL){
+        int empty = 1;
+        for(int i = 0; i < HASH_SIZE; ++i){
+            for(struct hashEntry* entry = pathCache[i]; entry != NULL; entry = entry->next){
+                if(empty){
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4u\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if(empty){
+            printf("hash: hash table empty\n");
+        }
+        fflush(stdout);
+        return 0;
+    }
+    if(!strcmp(args[1], "-r")){
+        hashClear();
+        return 0;
+    }
+    int status = 0;
+    for(int i = 1; args[i] != NULL; ++i){
+        hashForget(args[i]);
+        if(hashLookup(args[i]) == NULL){
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+Reports why a stage could not be spawned. posix_spawn() returns one error for a failed open or exec,
+so the redirections are checked first to name the right file.
+*/
+void spawnError(struct Input* process, int stage, int err){
+    char* name = process->args[process->stages[stage]];
+    if(process->inputFile[stage] != NULL && access(process->inputFile[stage], R_OK)){
+        name = process->inputFile[stage];
+    }
+    else if(process->outputFile[stage] != NULL && err != ENOENT && err != ENOEXEC){
+        name = process->outputFile[stage];
+    }
+    fprintf(stderr, "%s: %s\n", name, strerror(err));
+    fflush(stderr);
+}
+
+/*
+Function that opens file and puts it on descriptor fd, for builtin redirections
+Returns -1 and reports the error if the file cannot be opened.
+*/
+int redirectFd(const char* file, int fd, int flags){
+    int opened = open(file, flags, 0640);
+    if(opened == -1){
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        fflush(stderr);
+        return -1;
+    }
+    dup2(opened, fd);
+    close(opened);
+    return 0;
+}
+
+/*
+Function that runs a builtin as a pipeline stage or background job in a forked child. This is the one
+place left that needs fork(): the builtin runs shell code, not an exec, so it cannot be spawned.
+Returns the child pid, or -1 if fork() failed.
+*/
+pid_t forkBuiltin(const struct builtin* b, struct Input* process, int stage, int readFd, int writeFd, int otherFd, pid_t pgid){
+    // Nothing buffered may be written twice
+    fflush(NULL);
+    pid_t pid = fork();
+    if(pid != 0){
+        return pid;
+    }
+    setpgid(0, pgid);
+    // Same signal setup a spawned stage gets
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    // Pipes are close-on-exec, with no exec they have to be closed by hand
+    if(otherFd != -1){
+        close(otherFd);
+    }
+    if(readFd != -1){
+        dup2(readFd, 0);
+        close(readFd);
+    }
+    if(writeFd != -1){
+        dup2(writeFd, 1);
+        close(writeFd);
+    }
+    // A stage's own redirections replace its pipes
+    if(process->inputFile[stage] != NULL && redirectFd(process->inputFile[stage], 0, O_RDONLY)){
+        _exit(1);
+    }
+    if(process->outputFile[stage] != NULL && redirectFd(process->outputFile[stage], 1, O_WRONLY | O_CREAT | O_TRUNC)){
+        _exit(1);
+    }
+    int status = b->run(&process->args[process->stages[stage]]);
+    fflush(stdout);
+    _exit(status);
+}
+
+/*
+Starts every stage of a pipeline in one process group, each stage reading the pipe from the stage
+before it. Stages are started with posix_spawn() on the cached command path, which shares the shell's
+memory until the exec instead of copying its page tables, with the redirections and signal resets done
+as spawn actions.
+Builtin stages are forked instead, and a file the kernel cannot execute is spawned again under /bin/sh.
+Stores the pid of each stage in pids, -1 for a stage that could not start, and returns the process
+group id.
+*/
+pid_t launchPipeline(struct Input* process, pid_t* pids){
+    pid_t pgid = 0;
+    int prevRead = -1;
+    for(int i = 0; i < process->nstages; ++i){
+        int last = i == process->nstages - 1;
+        int fds[2] = {-1, -1};
+        // Close on exec so no stage keeps another stage's pipe open
+        if(!last && pipe2(fds, O_CLOEXEC) == -1){
+            perror("pipe2()");
+            exit(1);
+        }
+
+        char** argv = &process->args[process->stages[i]];
+        pid_t spawnpid;
+        int err = 0;
+        const struct builtin* b = findBuiltin(argv[0]);
+        if(b != NULL){
+            spawnpid = forkBuiltin(b, process, i, prevRead, fds[1], fds[0], pgid);
+            if(spawnpid == -1){
+                err = errno;
+            }
+        }
+        else{
+            posix_spawn_file_actions_t actions;
+            posix_spawn_file_actions_init(&actions);
+            // Connect the pipes to the stages on either side
+            if(prevRead != -1){
+                posix_spawn_file_actions_adddup2(&actions, prevRead, 0);
+            }
+            if(!last){
+                posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+            }
+            // Redirections written after this stage come after the pipes, so they win as in sh
+            if(process->inputFile[i] != NULL){
+                posix_spawn_file_actions_addopen(&actions, 0, process->inputFile[i], O_RDONLY, 0);
+            }
+            if(process->outputFile[i] != NULL){
+                posix_spawn_file_actions_addopen(&actions, 1, process->outputFile[i], O_WRONLY | O_CREAT | O_TRUNC, 0640);
+            }
+
+            posix_spawnattr_t attr;
+            posix_spawnattr_init(&attr);
+            // Join the pipeline's process group, the first stage leads it
+            posix_spawnattr_setpgroup(&attr, pgid);
+            // Enable ^C for the child, and let it use the terminal the shell hands over
+            sigset_t defaults;
+            sigemptyset(&defaults);
+            sigaddset(&defaults, SIGINT);
+            sigaddset(&defaults, SIGTTOU);
+            sigaddset(&defaults, SIGTTIN);
+            sigaddset(&defaults, SIGTSTP);
+            posix_spawnattr_setsigdefault(&attr, &defaults);
+            sigset_t mask;
+            sigemptyset(&mask);
+            posix_spawnattr_setsigmask(&attr, &mask);
+            posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_USEVFORK);
+
+            const char* file = hashLookup(argv[0]);
+            err = file ? posix_spawn(&spawnpid, file, &actions, &attr, argv, environ) : ENOENT;
+            // A cached path that has gone away, search PATH again once
+            if(err == ENOENT && file != NULL && file != argv[0]){
+                hashForget(argv[0]);
+                file = hashLookup(argv[0]);
+                err = file ? posix_spawn(&spawnpid, file, &actions, &attr, argv, environ) : ENOENT;
+            }
+            // An executable without a #! line is a shell script, run it with /bin/sh as execvp() does
+            if(err == ENOEXEC){
+                char* shArgv[MAX_ARGS + 2];
+                int n = 0;
+                shArgv[n++] = "/bin/sh";
+                shArgv[n++] = (char*)file;
+                for(char** arg = argv + 1; *arg != NULL; ++arg){
+                    shArgv[n++] = *arg;
+                }
+                shArgv[n] = NULL;
+                err = posix_spawn(&spawnpid, "/bin/sh", &actions, &attr, shArgv, environ);
+            }
+            posix_spawnattr_destroy(&attr);
+            posix_spawn_file_actions_destroy(&actions);
+        }
+        if(err){
+            spawnError(process, i, err);
+            spawnpid = -1;
+        }
+        else{
+            // Set the group here too so it exists before anyone waits on it
+            if(pgid == 0){
+                pgid = spawnpid;
+            }
+            setpgid(spawnpid, pgid);
+        }
+        pids[i] = spawnpid;
+        if(prevRead != -1){
+            close(prevRead);
+        }
+        if(!last){
+            close(fds[1]);
+        }
+        prevRead = fds[0];
+    }
+    return pgid;
+}
+
+/*
+Function that reads the monotonic clock in ns
+*/
+long long monoNs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+Function that adds the resources of one reaped process from wait4() to a command's usage
+*/
+void usageAdd(struct usage* usage, const struct rusage* ru){
+    usage->user += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    usage->sys += ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    if(ru->ru_maxrss > usage->maxrss){
+        usage->maxrss = ru->ru_maxrss;
+    }
+    usage->ctxsw += ru->ru_nvcsw + ru->ru_nivcsw;
+}
+
+/*
+Function that reports a finished command's usage: a line on stderr if it was timed, and one JSON record
+in the SMALLSH_STATS log. The record is written with a single write() so concurrent shells sharing a log
+do not interleave.
+*/
+void usageReport(struct usage* usage, const char* cmd, pid_t pid, int status, int background, int timed){
+    double real = (monoNs() - usage->start) / 1e9;
+    if(timed){
+        fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldkB  ctxsw %ld\n",
+                real, usage->user, usage->sys, usage->maxrss, usage->ctxsw);
+        fflush(stderr);
+    }
+    if(statsFd == -1){
+        return;
+    }
+    char record[1024];
+    int n = snprintf(record, sizeof(record), "{\"pid\":%d,\"cmd\":\"", pid);
+    // Escape the command as a JSON string
+    for(const char* c = cmd; *c && n < (int)sizeof(record) - 160; ++c){
+        if(*c == '"' || *c == '\\'){
+            record[n++] = '\\';
+            record[n++] = *c;
+        }
+        else if((unsigned char)*c < 0x20){
+            n += sprintf(record + n, "\\u%04x", *c);
+        }
+        else{
+            record[n++] = *c;
+        }
+    }
+    n += snprintf(record + n, sizeof(record) - n,
+                  "\",\"status\":%d,\"bg\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss\":%ld,\"ctxsw\":%ld}\n",
+                  status, background, real, usage->user, usage->sys, usage->maxrss, usage->ctxsw);
+    write(statsFd, record, n);
+}
+
+/*
+Function that adds a started pipeline to the job table with the next free job number
+*/
+struct job* jobAdd(struct Input* process, pid_t pgid, pid_t* pids, int background, long long start){
+    struct job* job = calloc(1, sizeof(struct job));
+    job->pgid = pgid;
+    job->timed = process->timed;
+    job->usage.start = start;
+    job->state = JOB_RUNNING;
+    job->background = background;
+    // A last stage that never started counts as exit value 1
+    job->status = W_EXITCODE(1, 0);
+    job->lastPid = pgid;
+    for(int i = 0; i < process->nstages; ++i){
+        job->pids[i] = pids[i];
+        if(pids[i] != -1){
+            job->alive++;
+            job->lastPid = pids[i];
+        }
+    }
+    snprintf(job->cmd, sizeof(job->cmd), "%s", process->line);
+
+    // Number after the highest job still in the table, appended to keep id order
+    struct job** link = &jobList;
+    job->id = 1;
+    while(*link != NULL){
+        job->id = (*link)->id + 1;
+        link = &(*link)->next;
+    }
+    *link = job;
+    return job;
+}
+
+/*
+Function that removes a job from the table and frees it
+*/
+void jobRemove(struct job* job){
+    for(struct job** link = &jobList; *link != NULL; link = &(*link)->next){
+        if(*link == job){
+            *link = job->next;
+            free(job);
+            return;
+        }
+    }
+}
+
+/*
+Function that turns a wait status into an exit value: the exit status, or 128 plus the signal number for
+a process killed by a signal
+*/
+int exitValue(int status){
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/*
+Function that records a wait status and resource use from wait4() against the job owning pid.
+The job's usage is reported once its last process is reaped.
+*/
+void jobUpdate(pid_t pid, int status, const struct rusage* ru){
+    for(struct job* job = jobList; job != NULL; job = job->next){
+        for(int i = 0; i < MAX_PIPE; ++i){
+            if(job->pids[i] != pid || pid == -1){
+                continue;
+            }
+            if(WIFSTOPPED(status)){
+                job->state = JOB_STOPPED;
+            }
+            else if(WIFCONTINUED(status)){
+                job->state = JOB_RUNNING;
+            }
+            else{
+                job->pids[i] = -1;
+                usageAdd(&job->usage, ru);
+                if(pid == job->lastPid){
+                    job->status = status;
+                }
+                if(--job->alive == 0){
+                    job->state = JOB_DONE;
+                    if(job->timed || statsFd != -1){
+                        usageReport(&job->usage, job->cmd, job->lastPid, exitValue(job->status), job->background, job->timed);
+                    }
+                }
+            }
+            return;
+        }
+    }
+}
+
+/*
+Function that reports finished and newly stopped background jobs, removing the finished ones.
+Without prompts nothing is reported, so finished jobs stay for wait to collect their status, up to the
+DONE_JOBS_KEPT most recent.
+Returns the number of lines printed.
+*/
+int jobNotify(){
+    int printed = 0;
+    int done = 0;
+    for(struct job* job = jobList; job != NULL; job = job->next){
+        done += job->background && job->state == JOB_DONE;
+    }
+    struct job* job = jobList;
+    while(job != NULL){
+        struct job* next = job->next;
+        if(job->background && job->state == JOB_DONE && !interactive){
+            // Oldest first, the list is in id order
+            if(done-- > DONE_JOBS_KEPT){
+                jobRemove(job);
+            }
+        }
+        else if(job->background && job->state == JOB_DONE){
+            // How did the process finish?
+            if(WIFEXITED(job->status)){
+                printf("Child %d exited normally with status %d\n", job->lastPid, WEXITSTATUS(job->status));
+            }
+            else{
+                printf("Child %d exited abnormally due to signal %d\n", job->lastPid, WTERMSIG(job->status));
+            }
+            jobRemove(job);
+            printed++;
+        }
+        else if(job->state == JOB_STOPPED && !job->notified){
+            printf("[%d]+  Stopped\t%s\n", job->id, job->cmd);
+            job->notified = 1;
+            printed++;
+        }
+        job = next;
+    }
+    fflush(stdout);
+    return printed;
+}
+
+/*
+Function that reaps every child with a status change without blocking, then reports background jobs
+Returns the number of lines printed.
+*/
+int reapJobs(){
+    int childStatus;
+    struct rusage ru;
+    pid_t pid;
+    // Everything pending is reaped below, so the SIGCHLD descriptor can be emptied
+    struct signalfd_siginfo info;
+    while(read(sigchldFd, &info, sizeof(info)) > 0);
+    // -1 to indicate any process, > 0 to indicate that a process that changed was found
+    while((pid = wait4(-1, &childStatus, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0){
+        jobUpdate(pid, childStatus, &ru);
+    }
+    return jobNotify();
+}
+
+/*
+Function that blocks until a job finishes or stops. Any child is reaped meanwhile, so background jobs
+that finish during a long foreground command do not stay zombies.
+*/
+void waitJob(struct job* job){
+    while(job->state == JOB_RUNNING){
+        int childStatus;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &childStatus, WUNTRACED | WCONTINUED, &ru);
+        if(pid == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            // No children left to wait for
+            job->state = JOB_DONE;
+            break;
+        }
+        jobUpdate(pid, childStatus, &ru);
+    }
+}
+
+/*
+Function that runs a job in the foreground: hands it the terminal, waits for it, and takes the terminal
+back. A finished job sets the status and leaves the table; a stopped one stays as a background job.
+*/
+void foregroundJob(struct job* job){
+    job->background = 0;
+    // Give the terminal to the pipeline so ^C reaches every stage
+    if(isatty(STDIN_FILENO)){
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    waitJob(job);
+    if(isatty(STDIN_FILENO)){
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    if(job->state == JOB_STOPPED){
+        job->background = 1;
+        job->notified = 0;
+        lastStatus = 128 + SIGTSTP;
+    }
+    else{
+        // Status of a pipeline is the status of its last stage
+        lastStatus = exitValue(job->status);
+        jobRemove(job);
+    }
+}
+
+/*
+Function that finds the job named by a job spec: %N is job number N, a bare number is a job number,
+or a pid if byPid is set. No spec means the most recent job.
+*/
+struct job* jobFind(const char* spec, int byPid){
+    struct job* found = NULL;
+    for(struct job* job = jobList; job != NULL; job = job->next){
+        if(spec == NULL){
+            found = job;
+        }
+        else if(spec[0] == '%' || !byPid){
+            if(job->id == atoi(spec + (spec[0] == '%'))){
+                return job;
+            }
+        }
+        else{
+            for(int i = 0; i < MAX_PIPE; ++i){
+                if(job->pids[i] == atoi(spec) || job->pgid == atoi(spec) || job->lastPid == atoi(spec)){
+                    return job;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+/*
+Function for the jobs builtin, lists the job table. Finished jobs are listed once and then forgotten.
+*/
+int jobsBuiltin(char** args){
+    reapJobs();
+    struct job* job = jobList;
+    while(job != NULL){
+        struct job* next = job->next;
+        const char* state = job->state == JOB_RUNNING ? "Running" : job->state == JOB_STOPPED ? "Stopped" : "Done";
+        printf("[%d]%c  %-24s%s\n", job->id, next == NULL ? '+' : ' ', state, job->cmd);
+        if(job->state == JOB_DONE){
+            jobRemove(job);
+        }
+        job = next;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*
+Function that counts background jobs still running
+*/
+int runningJobs(){
+    int count = 0;
+    for(struct job* job = jobList; job != NULL; job = job->next){
+        count += job->background && job->state == JOB_RUNNING;
+    }
+    return count;
+}
+
+/*
+Function that blocks until at most limit background jobs are running, then reports the finished ones.
+A limit of 0 waits for every running job, stopped jobs would never finish.
+*/
+void waitJobs(int limit){
+    while(runningJobs() > limit){
+        int childStatus;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &childStatus, WUNTRACED, &ru);
+        if(pid > 0){
+            jobUpdate(pid, childStatus, &ru);
+        }
+        else if(errno != EINTR){
+            break;
+        }
+    }
+    jobNotify();
+}
+
+/*
+Function for the wait builtin: waits for one job, or every running job with no argument. A job that has
+already finished returns its kept status and leaves the table.
+*/
+int waitBuiltin(char** args){
+    if(args[1] == NULL){
+        waitJobs(0);
+        // Every status is collected
+        struct job* job = jobList;
+        while(job != NULL){
+            struct job* next = job->next;
+            if(job->state == JOB_DONE){
+                jobRemove(job);
+            }
+            job = next;
+        }
+        return 0;
+    }
+    struct job* job = jobFind(args[1], 1);
+    if(job == NULL){
+        fprintf(stderr, "wait: %s: no such job\n", args[1]);
+        return 127;
+    }
+    waitJob(job);
+    int status = job->state == JOB_STOPPED ? 128 + SIGTSTP : exitValue(job->status);
+    if(job->state == JOB_DONE){
+        jobRemove(job);
+    }
+    jobNotify();
+    return status;
+}
+
+/*
+Function for the fg and bg builtins, continues a job in the foreground or the background
+*/
+int continueBuiltin(char** args, int foreground){
+    struct job* job = jobFind(args[1], 0);
+    if(job == NULL){
+        fprintf(stderr, "%s: %s: no such job\n", args[0], args[1] ? args[1] : "current");
+        return 1;
+    }
+    if(foreground){
+        printf("%s\n", job->cmd);
+    }
+    else{
+        printf("[%d] %s\n", job->id, job->cmd);
+    }
+    fflush(stdout);
+    if(job->state == JOB_STOPPED){
+        job->state = JOB_RUNNING;
+    }
+    job->notified = 0;
+    kill(-job->pgid, SIGCONT);
+    if(foreground){
+        foregroundJob(job);
+        return lastStatus;
+    }
+    job->background = 1;
+    return 0;
+}
+
+int fgBuiltin(char** args){
+    return continueBuiltin(args, 1);
+}
+
+int bgBuiltin(char** args){
+    return continueBuiltin(args, 0);
+}
+
+/*
+Function that reads one line of commands into line, without the newline. Waits with poll() on inFd and
+the SIGCHLD descriptor, so background jobs are reaped and reported as soon as they finish, even while
+the shell sits at the prompt.
+Returns -1 at end of input.
+*/
+int readLine(char* line){
+    if(scriptText != NULL){
+        if(*scriptText == 0){
+            return -1;
+        }
+        size_t len = strcspn(scriptText, "\n");
+        if(len > CLI_LENGTH - 1){
+            len = CLI_LENGTH - 1;
+        }
+        memcpy(line, scriptText, len);
+        line[len] = 0;
+        scriptText += len + (scriptText[len] == '\n');
+        return 0;
+    }
+    while(1){
+        char* nl = memchr(inBuf + inStart, '\n', inEnd - inStart);
+        // A full line, a line as long as the buffer, or the last line without a newline
+        if(nl != NULL || (inStart == 0 && inEnd == sizeof(inBuf) - 1) || (inEof && inEnd > inStart)){
+            size_t len = nl ? (size_t)(nl - inBuf - inStart) : inEnd - inStart;
+            memcpy(line, inBuf + inStart, len);
+            line[len] = 0;
+            inStart += len + (nl != NULL);
+            return 0;
+        }
+        if(inEof){
+            return -1;
+        }
+        // Move the partial line to the front to make room
+        memmove(inBuf, inBuf + inStart, inEnd - inStart);
+        inEnd -= inStart;
+        inStart = 0;
+
+        struct pollfd fds[2] = {{inFd, POLLIN, 0}, {sigchldFd, POLLIN, 0}};
+        if(poll(fds, 2, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll()");
+            return -1;
+        }
+        if(fds[1].revents & POLLIN){
+            // Reprint the prompt under any job reports
+            if(reapJobs() && interactive){
+                fprintf(stdout, ": ");
+                fflush(stdout);
+            }
+        }
+        if(fds[0].revents){
+            ssize_t n = read(inFd, inBuf + inEnd, sizeof(inBuf) - 1 - inEnd);
+            if(n > 0){
+                inEnd += n;
+            }
+            else if(n == 0 || (errno != EINTR && errno != EAGAIN)){
+                inEof = 1;
+            }
+        }
+    }
+}
+
+/*
+Function that blocks SIGCHLD and opens the descriptor it is read from. Children get an empty signal
+mask when they are spawned.
+*/
+void jobsInit(){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sigchldFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(sigchldFd == -1){
+        perror("signalfd()");
+        exit(1);
+    }
+}
+
+/*
+Function for the exit builtin, the shell exits once the command is done, with N if given or else the
+last status
+*/
+int exitBuiltin(char** args){
+    if(args[1] != NULL && args[2] != NULL){
+        fprintf(stderr, "exit: too many arguments\n");
+        return 1;
+    }
+    exitRequested = 1;
+    if(args[1] == NULL){
+        return lastStatus;
+    }
+    char* end;
+    errno = 0;
+    long value = strtol(args[1], &end, 10);
+    if(end == args[1] || *end != 0 || errno){
+        fprintf(stderr, "exit: %s: numeric argument required\n", args[1]);
+        value = 2;
+    }
+    // Only the low 8 bits reach the parent
+    exitValueGiven = value & 0xFF;
+    return exitValueGiven;
+}
+
+/*
+Function for the cd builtin, with no argument it goes to the directory smallsh started in
+*/
+int cdBuiltin(char** args){
+    //If no arg, go home
+    if(args[1] == 0){
+        if(chdir(HOME_DIR)){
+            fprintf(stderr, "Error: could not switch to home directory\n");
+            return 1;
+        }
+        printf("Went Home %s\n", HOME_DIR);
+        fflush(stdout);
+        return 0;
+    }
+    char cwd[4096]; // Max pathname length for Linux
+    char pathName[4096];
+    // Add / before directory to change to if not absolute path
+    if(args[1][0] != '/'){
+        strcpy(pathName, strcat(getcwd(cwd, sizeof(cwd)), "//"));
+        strcat(pathName, args[1]);
+    }
+    else{
+        strcpy(pathName, args[1]);
+    }
+
+    if(chdir(pathName)){
+        fprintf(stderr, "Error: could not switch to new directory\n");
+        fflush(stdout);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Function for the status builtin, leaves the status it prints unchanged
+*/
+int statusBuiltin(char** args){
+    printf("exit value %d\n", lastStatus);
+    fflush(stdout);
+    return lastStatus;
+}
+
+int trueBuiltin(char** args){
+    return 0;
+}
+
+int falseBuiltin(char** args){
+    return 1;
+}
+
+/*
+Function for the echo builtin, -n leaves off the newline
+*/
+int echoBuiltin(char** args){
+    int newline = 1;
+    int i = 1;
+    if(args[1] != NULL && !strcmp(args[1], "-n")){
+        newline = 0;
+        ++i;
+    }
+    for(; args[i] != NULL; ++i){
+        fputs(args[i], stdout);
+        if(args[i + 1] != NULL){
+            putchar(' ');
+        }
+    }
+    if(newline){
+        putchar('\n');
+    }
+    return 0;
+}
+
+int pwdBuiltin(char** args){
+    char cwd[4096]; // Max pathname length for Linux
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    return 0;
+}
+
+/*
+Function that parses an integer operand for test, setting *bad if it is not one
+*/
+long long testNumber(const char* arg, int* bad){
+    char* end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    if(end == arg || *end != 0 || errno){
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        *bad = 1;
+    }
+    return value;
+}
+
+/*
+Function for test's unary operators
+Returns 0 for true, 1 for false, 2 for an unknown operator.
+*/
+int testUnary(const char* op, const char* arg){
+    struct stat sb;
+    if(op[0] != '-' || op[1] == 0 || op[2] != 0){
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    switch(op[1]){
+        case 'n':
+            return arg[0] == 0;
+        case 'z':
+            return arg[0] != 0;
+        case 'r':
+            return access(arg, R_OK) != 0;
+        case 'w':
+            return access(arg, W_OK) != 0;
+        case 'x':
+            return access(arg, X_OK) != 0;
+        case 't':
+            return !isatty(atoi(arg));
+        case 'h':
+        case 'L':
+            return lstat(arg, &sb) || !S_ISLNK(sb.st_mode);
+    }
+    if(!strchr("efdsbcpS", op[1])){
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    if(stat(arg, &sb)){
+        return 1;
+    }
+    switch(op[1]){
+        case 'f':
+            return !S_ISREG(sb.st_mode);
+        case 'd':
+            return !S_ISDIR(sb.st_mode);
+        case 's':
+            return sb.st_size == 0;
+        case 'b':
+            return !S_ISBLK(sb.st_mode);
+        case 'c':
+            return !S_ISCHR(sb.st_mode);
+        case 'p':
+            return !S_ISFIFO(sb.st_mode);
+        case 'S':
+            return !S_ISSOCK(sb.st_mode);
     }
+    // -e
+    return 0;
 }
 
 /*
-Function for expading instances of $$ in arguments
+Function for test's binary operators
+Returns 0 for true, 1 for false, 2 for a bad operand, -1 if op is not a binary operator.
 */
-char* varExpansion(char* arg, char* pid){
-    // Get first instance location of $$
-    char* substring = strstr(arg, "$$");
-
-    // No instances of $$
-    if(substring == NULL){
-        return NULL;
+int testBinary(const char* left, const char* op, const char* right){
+    if(!strcmp(op, "=")){
+        return strcmp(left, right) != 0;
+    }
+    if(!strcmp(op, "!=")){
+        return strcmp(left, right) == 0;
     }
+    const char* ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for(int i = 0; i < 6; ++i){
+        if(strcmp(op, ops[i])){
+            continue;
+        }
+        int bad = 0;
+        long long a = testNumber(left, &bad);
+        long long b = testNumber(right, &bad);
+        if(bad){
+            return 2;
+        }
+        int result[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+        return !result[i];
+    }
+    return -1;
+}
 
-    int subLen = strlen(substring) - 1;
+/*
+Function that evaluates a test expression by its number of arguments, following the POSIX rules
+Returns 0 for true, 1 for false, 2 for an error.
+*/
+int testEval(int argc, char** argv){
+    int result;
+    switch(argc){
+        case 0:
+            return 1;
+        case 1:
+            return argv[0][0] == 0;
+        case 2:
+            if(!strcmp(argv[0], "!")){
+                result = testEval(1, argv + 1);
+                return result == 2 ? 2 : !result;
+            }
+            return testUnary(argv[0], argv[1]);
+        case 3:
+            result = testBinary(argv[0], argv[1], argv[2]);
+            if(result != -1){
+                return result;
+            }
+            if(!strcmp(argv[0], "!")){
+                result = testEval(2, argv + 1);
+                return result == 2 ? 2 : !result;
+            }
+            if(!strcmp(argv[0], "(") && !strcmp(argv[2], ")")){
+                return testEval(1, argv + 1);
+            }
+            fprintf(stderr, "test: %s: binary operator expected\n", argv[1]);
+            return 2;
+        case 4:
+            if(!strcmp(argv[0], "!")){
+                result = testEval(3, argv + 1);
+                return result == 2 ? 2 : !result;
+            }
+            if(!strcmp(argv[0], "(") && !strcmp(argv[3], ")")){
+                return testEval(2, argv + 1);
+            }
+    }
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
 
-    // Adapted from CodeVault's "Replace substrings"
-    // Adjust space at $$ to size of pid
-    memmove(substring + strlen(pid), substring + 2, subLen);
-    // Copy the pid into the argument at the location of $$
-    memcpy(substring, pid, strlen(pid));
+/*
+Function for the test and [ builtins
+*/
+int testBuiltin(char** args){
+    int argc = 0;
+    while(args[argc + 1] != NULL){
+        ++argc;
+    }
+    if(!strcmp(args[0], "[")){
+        if(argc == 0 || strcmp(args[argc], "]")){
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        --argc;
+    }
+    return testEval(argc, args + 1);
+}
 
-    // Return non-NULL value
-    return substring;
+/*
+Function that prints the backslash escape at p for printf, octal escapes take up to 3 digits after
+the backslash, or after \0 when octalZero is set (the %b form)
+Returns a pointer to the last character of the escape.
+*/
+const char* printEscape(const char* p, int octalZero){
+    const char* from = "abfnrtv\\\"'";
+    const char* to = "\a\b\f\n\r\t\v\\\"'";
+    const char* found = p[1] ? strchr(from, p[1]) : NULL;
+    if(found != NULL){
+        putchar(to[found - from]);
+        return p + 1;
+    }
+    if(p[1] >= '0' && p[1] <= '7'){
+        ++p;
+        if(octalZero && *p == '0'){
+            ++p;
+        }
+        int value = 0;
+        int digits = 0;
+        while(digits < 3 && *p >= '0' && *p <= '7'){
+            value = value * 8 + (*p++ - '0');
+            ++digits;
+        }
+        putchar(value);
+        return p - 1;
+    }
+    putchar('\\');
+    return p;
 }
 
 /*
-Command Execution
+Function that reads a numeric printf argument, a leading quote gives the character's value
 */
-int runCmd(struct Input process, struct sigaction SIGINT_action){
-    // Exit smallsh
-    if(!strcmp(process.args[0], "exit")){
-        return -1;
+long long printfNumber(const char* arg, int* status){
+    if(arg == NULL){
+        return 0;
+    }
+    if(arg[0] == '\'' || arg[0] == '"'){
+        return (unsigned char)arg[1];
     }
+    char* end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if(end == arg || *end != 0 || errno){
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
 
-    // CD Process
-    else if(!strcmp(process.args[0], "cd")){
-        //If no arg, go home
-        if(process.args[1] == 0){
-            if(chdir(HOME_DIR)){
-                fprintf(stderr, "Error: could not switch to home directory\n");
-                return 1;
+/*
+Function for the printf builtin: %s %b %c %d %i %u %o %x %X %% with flags, width and precision, and
+backslash escapes. The format is reused while arguments remain.
+*/
+int printfBuiltin(char** args){
+    if(args[1] == NULL){
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    int status = 0;
+    char** arg = args + 2;
+    char** passStart;
+    do{
+        passStart = arg;
+        for(const char* f = args[1]; *f; ++f){
+            if(*f == '\\'){
+                f = printEscape(f, 0);
+                continue;
             }
-            else{
-                printf("Went Home %s\n", HOME_DIR);
-                fflush(stdout);
+            if(*f != '%'){
+                putchar(*f);
+                continue;
             }
-        }
-        else{
-            char cwd[4096]; // Max pathname length for Linux
-            char pathName[4096];
-            // Add / before directory to change to if not absolute path
-            if(process.args[1][0] != '/'){
-                strcpy(pathName, strcat(getcwd(cwd, sizeof(cwd)), "//"));
-                strcat(pathName, process.args[1]);
+            if(f[1] == '%'){
+                putchar('%');
+                ++f;
+                continue;
             }
-            else{
-                strcpy(pathName, process.args[1]);
+            // Copy the conversion spec for the C printf, with room for the ll length
+            char spec[32];
+            size_t n = 0;
+            spec[n++] = *f++;
+            while(*f && strchr("-+ #0", *f) && n < 8){
+                spec[n++] = *f++;
             }
-
-            if(chdir(pathName)){
-                fprintf(stderr, "Error: could not switch to new directory\n");
-                fflush(stdout);
-                return 1;
+            while(isdigit((unsigned char)*f) && n < 16){
+                spec[n++] = *f++;
+            }
+            if(*f == '.'){
+                spec[n++] = *f++;
+                while(isdigit((unsigned char)*f) && n < 24){
+                    spec[n++] = *f++;
+                }
+            }
+            const char* value = *arg != NULL ? *arg++ : NULL;
+            switch(*f){
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = 0;
+                    printf(spec, value ? value : "");
+                    break;
+                case 'c':{
+                    char c[2] = {value ? value[0] : 0, 0};
+                    spec[n++] = 's';
+                    spec[n] = 0;
+                    printf(spec, c);
+                    break;
+                }
+                case 'b':
+                    for(const char* b = value ? value : ""; *b; ++b){
+                        if(*b == '\\'){
+                            b = printEscape(b, 1);
+                        }
+                        else{
+                            putchar(*b);
+                        }
+                    }
+                    break;
+                case 'd':
+                case 'i':
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = 'd';
+                    spec[n] = 0;
+                    printf(spec, printfNumber(value, &status));
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *f;
+                    spec[n] = 0;
+                    printf(spec, (unsigned long long)printfNumber(value, &status));
+                    break;
+                default:
+                    fflush(stdout);
+                    fprintf(stderr, "printf: %%%c: invalid directive\n", *f ? *f : ' ');
+                    return 1;
             }
         }
-        return 1;
-    }
-    // Status
-    else if(!strcmp(process.args[0], "status")){
-        printf("exit value %d\n", lastStatus);
-        fflush(stdout);
-    }
-    // Everything else
-    else{
-        // Garbage value to initiate spawnpid
-        pid_t spawnpid = -5;
-        int childStatus;
-
-        // If fork is successful, the value of spawnpid will be 0 in the child, the child's pid in the parent
-        spawnpid = fork();
-        int childPid = spawnpid;
+    } while(*arg != NULL && arg != passStart);
+    return status;
+}
 
-        // Switch status mirrors canvas module
-        switch (spawnpid){
-            case -1:
-            // Code in this branch will be exected by the parent when fork() fails and the creation of child process fails as well
-                perror("fork() failed!");
-                exit(1);
-                break;
+// Sorted by name for bsearch()
+const struct builtin builtins[] = {
+    {"[", testBuiltin},
+    {"bg", bgBuiltin},
+    {"cd", cdBuiltin},
+    {"echo", echoBuiltin},
+    {"exit", exitBuiltin},
+    {"false", falseBuiltin},
+    {"fg", fgBuiltin},
+    {"hash", hashBuiltin},
+    {"jobs", jobsBuiltin},
+    {"printf", printfBuiltin},
+    {"pwd", pwdBuiltin},
+    {"status", statusBuiltin},
+    {"test", testBuiltin},
+    {"true", trueBuiltin},
+    {"wait", waitBuiltin},
+};
 
-            case 0:
-            // spawnpid is 0 in the child;
-                // To not ruin os1
-                alarm(600);
-
-                // If input file is specified
-                if(strlen(process.inputFile) != 0){
-                    int sourceFD = open(process.inputFile, O_RDONLY);
-                    if (sourceFD == -1) {
-                        perror(process.inputFile); 
-                        exit(1); 
-                    }
-                    // Written to terminal
-                    printf("sourceFD == %d\n", sourceFD); 
-                    fflush(stdout);
-                    // Store file description for input to command
-                    int result = dup2(sourceFD, 0);
-                    if (result == -1) { 
-                        perror("source dup2()"); 
-                        exit(2); 
-                    }
-                }
+int builtinCompare(const void* name, const void* entry){
+    return strcmp(name, ((const struct builtin*)entry)->name);
+}
 
-                // If output file is specified
-                if(strlen(process.outputFile) != 0){
-                    int targetFD = open(process.outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0640);
-                    if (targetFD == -1) {                      
-                        perror(process.outputFile);
-                        exit(1);
-                    }
-                    // Currently printf writes to the terminal
-                    printf("The file descriptor for targetFD is %d\n", targetFD);
-                    fflush(stdout);
-                    // Use dup2 to point FD 1, i.e., standard output to targetFD
-                    int result = dup2(targetFD, 1);
-                    if (result == -1) {
-                        perror("target dup2"); 
-                        exit(2); 
-                    }
-                    // Now whatever we write to standard out will be written to targetFD
-                }
+/*
+Function that looks a command up in the builtin table
+Returns NULL if it is not a builtin.
+*/
+const struct builtin* findBuiltin(const char* name){
+    return bsearch(name, builtins, sizeof(builtins) / sizeof(builtins[0]), sizeof(builtins[0]), builtinCompare);
+}
 
-                //Enable ^C signal for child process
-                SIGINT_action.sa_handler = SIG_DFL;
-                // Install signal handler
-                sigaction(SIGINT, &SIGINT_action, NULL);
-                //invoke execvp()
-                execvp(process.args[0], (char* const*)process.args);
-                perror(process.args[0]);
-                exit(EXIT_FAILURE);
+/*
+Function that runs a builtin in the shell process. Redirections are applied to the shell's own
+descriptors, which are saved first and put back afterwards.
+Returns the builtin's exit value.
+*/
+int runBuiltin(const struct builtin* b, struct Input* process){
+    int saved[2] = {-1, -1};
+    int status = 1;
+    fflush(stdout);
+    if(process->inputFile[0] != NULL){
+        saved[0] = fcntl(0, F_DUPFD_CLOEXEC, 10);
+    }
+    if(process->outputFile[0] != NULL){
+        saved[1] = fcntl(1, F_DUPFD_CLOEXEC, 10);
+    }
+    if((process->inputFile[0] == NULL || !redirectFd(process->inputFile[0], 0, O_RDONLY))
+       && (process->outputFile[0] == NULL || !redirectFd(process->outputFile[0], 1, O_WRONLY | O_CREAT | O_TRUNC))){
+        status = b->run(process->args);
+    }
+    fflush(stdout);
+    for(int fd = 0; fd < 2; ++fd){
+        if(saved[fd] != -1){
+            dup2(saved[fd], fd);
+            close(saved[fd]);
+        }
+    }
+    return status;
+}
 
-            default:
-            // spawnpid is the pid of the child
+/*
+Command Execution
+*/
+int runCmd(struct Input process){
+    // Builtins are measured here, pipelines when their job is reaped
+    struct usage usage = {0};
+    struct rusage before;
+    usage.start = monoNs();
+    if(process.timed || statsFd != -1){
+        getrusage(RUSAGE_SELF, &before);
+    }
+    const struct builtin* b = findBuiltin(process.args[0]);
+    // if background character found and foreground only not enabled by ^Z
+    int background = process.background && !foregroundOnly;
+    // Builtins run in the shell only on their own in the foreground, anything else gets its own process
+    int builtin = b != NULL && process.nstages == 1 && !background;
 
-                // if background character found and foreground only not enabled by ^Z
-                if(process.background && !foregroundOnly){
-                    // WNOHANG specified. If the child hasn't terminated, waitpid will immediately return with value 0
-                    childPid = waitpid(childPid, &childStatus, WNOHANG);
-                    printf("Background process ID: %d\n", spawnpid);
-                    fflush(stdout);
-                }
-                // Background not specified or not permitted
-                else{
-            		childPid = waitpid(childPid, &childStatus, 0);
-                    lastStatus = WEXITSTATUS(childStatus);
-                }
+    if(builtin){
+        lastStatus = runBuiltin(b, &process);
+    }
+    // Everything else
+    else{
+        // With -j, a background job waits for a free slot before it starts
+        if(background && jobSlots){
+            waitJobs(jobSlots - 1);
+        }
+        pid_t pids[MAX_PIPE];
+        pid_t pgid = launchPipeline(&process, pids);
 
-            // Check to see if any background processes have finished
-            // -1 to indicate any process, > 0 to indicate that a process that ended was found
-            while((spawnpid = waitpid(-1, &childStatus, WNOHANG)) > 0){
-                // How did the process finish?
-                if(WIFEXITED(childStatus)){
-                    printf("Child %d exited normally with status %d\n", spawnpid, WEXITSTATUS(childStatus));
-                    fflush(stdout);
-                } 
-                else{
-                    printf("Child %d exited abnormally due to signal %d\n", spawnpid, WTERMSIG(childStatus));
-                    fflush(stdout);
-                }
+        if(pgid == 0){
+            // Nothing started
+            if(!background){
+                lastStatus = 1;
+            }
+        }
+        else if(background){
+            jobAdd(&process, pgid, pids, 1, usage.start);
+            if(pids[process.nstages - 1] != -1 && interactive){
+                printf("Background process ID: %d\n", pids[process.nstages - 1]);
+                fflush(stdout);
             }
         }
+        // Background not specified or not permitted
+        else{
+            foregroundJob(jobAdd(&process, pgid, pids, 0, usage.start));
+        }
+    }
+    // Reap and report background jobs that finished or stopped meanwhile, after builtins too, since a
+    // script's buffered lines are read without polling for SIGCHLD
+    reapJobs();
+
+    if(builtin && (process.timed || statsFd != -1)){
+        struct rusage after;
+        getrusage(RUSAGE_SELF, &after);
+        usage.user = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+        usage.sys = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+        usage.maxrss = after.ru_maxrss;
+        usage.ctxsw = (after.ru_nvcsw + after.ru_nivcsw) - (before.ru_nvcsw + before.ru_nivcsw);
+        usageReport(&usage, process.line, getpid(), lastStatus, 0, process.timed);
+    }
+    // Exit smallsh
+    if(exitRequested){
+        return -1;
     }
     // No exit
     return 1;
@@ -281,69 +1660,119 @@ int shell(){
 	// Install our signal handler
 	sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+	// Ignore terminal writes from the background so the shell can hand the terminal to a pipeline
+	signal(SIGTTOU, SIG_IGN);
+
     //Command prompt
-    fprintf(stdout, ": ");
-    fflush(stdout);
+    if(interactive){
+        fprintf(stdout, ": ");
+        fflush(stdout);
+    }
     
     //Input buffer
     char input[CLI_LENGTH];
     memset(input, 0, sizeof(input));
     
     //Struct to hold the the process to be run informtion
+    // Cleared as a whole, the file names and stage list must start empty
     struct Input process;
-    memset(process.inputFile, 0, sizeof(input));
-    process.background = 0;
-    memset(process.args, 0, sizeof(process.args));
+    memset(&process, 0, sizeof(process));
+    process.nstages = 1;
 
-    // Get user input
-    fgets(input, CLI_LENGTH, stdin);
-    input[strlen(input) - 1] = 0;
+    // Get user input, end of input exits like the exit command
+    if(readLine(input) == -1){
+        return -1;
+    }
 
     // Ignore line with # or empty input
     if(input[0] == '#' || (!strcmp(input, ""))){
         return 1;
     }
 
-    pid_t pid = getpid();
-    // Convert PID to string, PID max for BASH is 32768 (5 spaces) + 1 for NULL
-    char pidStr[6];
-    memset(pidStr, 0, sizeof(pidStr));
-    sprintf(pidStr, "%d", pid);
-    
-    // Tokenize input into space delimited portions
-    char* token = strtok(input, " ");
+    // The lexer leaves input untouched, so it doubles as the command as typed
+    process.line = input;
+
+    // Split the line into words and operators in one pass
+    arenaUsed = 0;
+    const char* pos = input;
+    char* word;
+    int tok;
     int j = 0;
-    while(token != NULL){
-        // Background cahracter in input, remove and switch background to true
-        if(!strncmp(token, "&", 1)){
-            process.background = 1;
+    // Text of the token the syntax error is near, NULL for none
+    const char* syntaxError = NULL;
+    char near[2] = {0};
+    while((tok = nextToken(&pos, &word)) != TOK_END){
+        // Background is only allowed as the last token
+        if(process.background){
+            syntaxError = "&";
+            break;
         }
-        // Input file specified
-        else if(!strncmp(token, "<", 1)){
-            token = strtok(NULL, " ");
-            strcpy(process.inputFile, token);
+        if(tok == TOK_ERROR){
+            fprintf(stderr, "smallsh: syntax error: unterminated quote\n");
+            lastStatus = 2;
+            return 1;
         }
-        // Output file specified
-        else if(!strncmp(token, ">", 1)){
-            token = strtok(NULL, " ");
-            strcpy(process.outputFile, token);
+        if(tok == TOK_WORD){
+            // The time prefix reports the resources the rest of the line used
+            if(j == 0 && !process.timed && !strcmp(word, "time")){
+                process.timed = 1;
+            }
+            else if(j == MAX_ARGS - 1){
+                fprintf(stderr, "smallsh: too many arguments\n");
+                return 1;
+            }
+            else{
+                process.args[j++] = word;
+            }
         }
-        else{
-            process.args[j] = strdup(token);
-            //Variable expansion for $$
-            while(varExpansion(process.args[j], pidStr));
+        // Input or output file specified
+        else if(tok == TOK_IN || tok == TOK_OUT){
+            if(nextToken(&pos, &word) != TOK_WORD){
+                near[0] = pos[-1];
+                syntaxError = *pos ? near : "newline";
+                break;
+            }
+            // The redirection belongs to the stage it is written in
+            if(tok == TOK_IN){
+                process.inputFile[process.nstages - 1] = word;
+            }
+            else{
+                process.outputFile[process.nstages - 1] = word;
+            }
+        }
+        // Pipe to a new stage, the current stage's arguments end here
+        else if(tok == TOK_PIPE){
+            if(j == process.stages[process.nstages - 1] || process.nstages == MAX_PIPE || j == MAX_ARGS - 1){
+                syntaxError = "|";
+                break;
+            }
+            process.args[j++] = 0;
+            process.stages[process.nstages++] = j;
+        }
+        // Background cahracter in input, switch background to true
+        else if(tok == TOK_AMP){
+            process.background = 1;
         }
-        ++j;
-        token = strtok(NULL, " ");
     }
 
     process.args[j] = 0;
+    process.nargs = j + 1;
+    // A stage with no command, or a line of only redirections
+    if(syntaxError == NULL && j == process.stages[process.nstages - 1] && (process.nstages > 1 || process.background)){
+        syntaxError = process.background ? "&" : "|";
+    }
+    if(syntaxError != NULL){
+        fprintf(stderr, "smallsh: syntax error near `%s'\n", syntaxError);
+        // Exit value 2 for a line that cannot be parsed, as sh gives
+        lastStatus = 2;
+        return 1;
+    }
+    if(j == 0){
+        return 1;
+    }
 
     // Call to run command
-    int ret = runCmd(process, SIGINT_action);
-    for(int i = 0; process.args[i]; ++i){
-        free(process.args[i]);
-    }
+    int ret = runCmd(process);
     // If return is -1, exit has been called
     if(ret == -1){
         return -1;
@@ -354,10 +1783,346 @@ int shell(){
     }
 }
 
+/*
+Benchmark
+*/
+
+/*
+Benchmark results for one shell on one workload
+*/
+struct benchResult{
+    int commands;
+    double seconds;
+    double p50; // Launch to exit latency in us, negative when the shell has no stats log
+    double p99;
+    int zombies; // Most zombie children seen at once
+    long rss; // Peak RSS of the shell in kB
+};
+
+const char* benchNames[BENCH_WORKLOADS] = {"true", "exec", "redirect", "background", "pipeline"};
+
+/*
+Function that writes the script for a workload: builtin true, exec'd true, file redirections,
+background jobs collected by one wait, and 8 stage pipelines (one per 10 commands).
+Returns the number of commands in the script.
+*/
+int benchScript(FILE* f, int workload, int count, const char* dir){
+    int commands = 0;
+    for(int i = 0; i < count; ++i){
+        switch(workload){
+            case 0:
+                fprintf(f, "true\n");
+                break;
+            case 1:
+                fprintf(f, "/bin/true\n");
+                break;
+            case 2:
+                if(i % 2 == 0){
+                    fprintf(f, "/bin/echo %d > %s/r\n", i, dir);
+                }
+                else{
+                    fprintf(f, "/bin/cat < %s/r > %s/w\n", dir, dir);
+                }
+                break;
+            case 3:
+                fprintf(f, "/bin/true &\n");
+                break;
+            case 4:
+                if(i % 10 == 0){
+                    fprintf(f, "/bin/echo %d | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat | /bin/cat > /dev/null\n", i);
+                    commands++;
+                }
+                continue;
+        }
+        commands++;
+    }
+    if(workload == 3){
+        fprintf(f, "wait\n");
+        commands++;
+    }
+    return commands;
+}
+
+/*
+Function that samples a running shell from /proc: its zombie children and its peak RSS
+*/
+void benchSample(pid_t pid, struct benchResult* r){
+    char path[64];
+    char buf[4096];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", pid, pid);
+    FILE* f = fopen(path, "r");
+    if(f != NULL){
+        int zombies = 0;
+        int child;
+        while(fscanf(f, "%d", &child) == 1){
+            char statPath[64];
+            snprintf(statPath, sizeof(statPath), "/proc/%d/stat", child);
+            FILE* stat = fopen(statPath, "r");
+            if(stat == NULL){
+                continue;
+            }
+            size_t n = fread(buf, 1, sizeof(buf) - 1, stat);
+            buf[n] = 0;
+            fclose(stat);
+            // State follows the command name, which may itself hold ')'
+            char* end = strrchr(buf, ')');
+            if(end != NULL && end[1] == ' ' && end[2] == 'Z'){
+                zombies++;
+            }
+        }
+        fclose(f);
+        if(zombies > r->zombies){
+            r->zombies = zombies;
+        }
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if(f != NULL){
+        while(fgets(buf, sizeof(buf), f) != NULL){
+            long kb;
+            if(sscanf(buf, "VmHWM: %ld", &kb) == 1 && kb > r->rss){
+                r->rss = kb;
+            }
+        }
+        fclose(f);
+    }
+}
+
+/*
+Function that runs a shell on a script with no input or output, sampling it every millisecond until it
+exits. stats names the SMALLSH_STATS log to pass, or NULL for none.
+Returns the wall time in seconds, or a negative value if the shell failed.
+*/
+double benchExec(const char* shell, const char* script, const char* stats, struct benchResult* r){
+    long long start = monoNs();
+    pid_t pid = fork();
+    if(pid == -1){
+        perror("fork()");
+        return -1;
+    }
+    if(pid == 0){
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        if(stats != NULL){
+            setenv("SMALLSH_STATS", stats, 1);
+        }
+        else{
+            unsetenv("SMALLSH_STATS");
+        }
+        execl(shell, shell, script, (char*)NULL);
+        _exit(127);
+    }
+    int childStatus;
+    struct timespec tick = {0, 1000000};
+    while(waitpid(pid, &childStatus, WNOHANG) == 0){
+        benchSample(pid, r);
+        nanosleep(&tick, NULL);
+    }
+    double seconds = (monoNs() - start) / 1e9;
+    if(!WIFEXITED(childStatus) || WEXITSTATUS(childStatus) == 127){
+        return -1;
+    }
+    return seconds;
+}
+
+int benchCompare(const void* a, const void* b){
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+Function that reads the real times from a SMALLSH_STATS log into the p50 and p99 of a result
+*/
+void benchLatency(const char* stats, struct benchResult* r){
+    r->p50 = r->p99 = -1;
+    FILE* f = fopen(stats, "r");
+    if(f == NULL){
+        return;
+    }
+    size_t count = 0;
+    size_t cap = 1024;
+    double* real = malloc(cap * sizeof(double));
+    char record[2048];
+    while(fgets(record, sizeof(record), f) != NULL){
+        char* field = strstr(record, "\"real\":");
+        if(field == NULL){
+            continue;
+        }
+        if(count == cap){
+            cap *= 2;
+            real = realloc(real, cap * sizeof(double));
+        }
+        real[count++] = strtod(field + 7, NULL) * 1e6;
+    }
+    fclose(f);
+    if(count > 0){
+        qsort(real, count, sizeof(double), benchCompare);
+        r->p50 = real[(size_t)(0.50 * (count - 1))];
+        r->p99 = real[(size_t)(0.99 * (count - 1))];
+    }
+    free(real);
+}
+
+/*
+Function for -B: runs every workload on each shell and prints a table of commands per second, latency
+percentiles, peak zombies and peak RSS. smallsh is run a second time with SMALLSH_STATS for the
+latencies, so logging does not slow the throughput run. Other shells have no log and show - for them,
+as does a shell that exits before its RSS is sampled.
+Returns 0 if every run succeeded.
+*/
+int benchMain(char** shells, int nshells, int count){
+    char self[4096];
+    ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if(len == -1){
+        perror("readlink()");
+        return 1;
+    }
+    self[len] = 0;
+    const char* defaults[] = {self, "/usr/bin/dash", "/usr/bin/bash"};
+    const char* list[MAX_BENCH_SHELLS];
+    if(nshells == 0){
+        for(int i = 0; i < 3; ++i){
+            if(i == 0 || !access(defaults[i], X_OK)){
+                list[nshells++] = defaults[i];
+            }
+        }
+    }
+    else{
+        for(int i = 0; i < nshells && i < MAX_BENCH_SHELLS; ++i){
+            list[i] = shells[i];
+        }
+        nshells = nshells < MAX_BENCH_SHELLS ? nshells : MAX_BENCH_SHELLS;
+    }
+
+    char dir[] = "/tmp/smallsh-bench.XXXXXX";
+    if(mkdtemp(dir) == NULL){
+        perror("mkdtemp()");
+        return 1;
+    }
+    char script[64];
+    char stats[64];
+    snprintf(script, sizeof(script), "%s/script", dir);
+    snprintf(stats, sizeof(stats), "%s/stats", dir);
+
+    int failed = 0;
+    printf("%-10s %-11s %7s %9s %10s %9s %9s %8s %8s\n", "shell", "workload", "cmds", "seconds", "cmds/s", "p50 us", "p99 us", "zombies", "rss kB");
+    for(int w = 0; w < BENCH_WORKLOADS; ++w){
+        FILE* f = fopen(script, "w");
+        if(f == NULL){
+            perror(script);
+            return 1;
+        }
+        int commands = benchScript(f, w, count, dir);
+        fclose(f);
+
+        for(int i = 0; i < nshells; ++i){
+            struct benchResult r = {0};
+            r.commands = commands;
+            int smallsh = !strcmp(list[i], self);
+            r.seconds = benchExec(list[i], script, NULL, &r);
+            r.p50 = r.p99 = -1;
+            if(smallsh && r.seconds >= 0){
+                struct benchResult logged = {0};
+                unlink(stats);
+                if(benchExec(list[i], script, stats, &logged) >= 0){
+                    benchLatency(stats, &r);
+                }
+            }
+            const char* name = smallsh ? "smallsh" : strrchr(list[i], '/') ? strrchr(list[i], '/') + 1 : list[i];
+            if(r.seconds < 0){
+                printf("%-10s %-11s %7d %9s\n", name, benchNames[w], commands, "failed");
+                failed = 1;
+                continue;
+            }
+            char p50[16] = "-";
+            char p99[16] = "-";
+            char rss[24] = "-";
+            if(r.p50 >= 0){
+                snprintf(p50, sizeof(p50), "%.0f", r.p50);
+                snprintf(p99, sizeof(p99), "%.0f", r.p99);
+            }
+            // A shell that exits before the first sample has no RSS reading
+            if(r.rss > 0){
+                snprintf(rss, sizeof(rss), "%ld", r.rss);
+            }
+            printf("%-10s %-11s %7d %9.3f %10.0f %9s %9s %8d %8s\n", name, benchNames[w], commands,
+                   r.seconds, commands / r.seconds, p50, p99, r.zombies, rss);
+            fflush(stdout);
+        }
+    }
+
+    char path[64];
+    const char* files[] = {"script", "stats", "r", "w"};
+    for(int i = 0; i < 4; ++i){
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+    printf("p50/p99 are per-command latencies from SMALLSH_STATS, so only smallsh has them; - is no data\n");
+    return failed;
+}
+
 /*
 Main Loop
 */
-int main(){
+int main(int argc, char* argv[]){
+    int opt;
+    int bench = 0;
+    int benchCount = 2000;
+    while((opt = getopt(argc, argv, "c:j:Bn:")) != -1){
+        switch(opt){
+            // Benchmark shells on scripted workloads
+            case 'B':
+                bench = 1;
+                break;
+            case 'n':
+                benchCount = atoi(optarg);
+                break;
+            // Run commands from the argument
+            case 'c':
+                scriptText = optarg;
+                interactive = 0;
+                break;
+            // Limit running background jobs
+            case 'j':
+                jobSlots = atoi(optarg);
+                if(jobSlots < 1){
+                    fprintf(stderr, "smallsh: -j needs a positive number of job slots\n");
+                    return 2;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: smallsh [-j slots] [-c commands | file]\n"
+                                "       smallsh -B [-n commands] [shell...]\n");
+                return 2;
+        }
+    }
+    if(bench){
+        return benchMain(argv + optind, argc - optind, benchCount > 0 ? benchCount : 2000);
+    }
+    // Run commands from a script file
+    if(scriptText == NULL && optind < argc){
+        inFd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+        if(inFd == -1){
+            perror(argv[optind]);
+            return 127;
+        }
+        interactive = 0;
+    }
+
+    // Log one record per command
+    if(getenv("SMALLSH_STATS") != NULL){
+        statsFd = open(getenv("SMALLSH_STATS"), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(statsFd == -1){
+            perror(getenv("SMALLSH_STATS"));
+        }
+    }
+
+    sprintf(pidStr, "%d", getpid());
+    jobsInit();
     while(1){
         int status = shell();
 
@@ -366,5 +2131,13 @@ int main(){
         }
     }
 
-    return 0;
+    // A batch run is done when its jobs are
+    if(jobSlots){
+        waitJobs(0);
+    }
+    // exit N sets the value, otherwise scripts report the status of their last command
+    if(exitValueGiven != -1){
+        return exitValueGiven;
+    }
+    return interactive ? 0 : lastStatus;
 }